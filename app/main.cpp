@@ -6,11 +6,18 @@
 
 #include <boost/filesystem.hpp>
 #include <boost/program_options.hpp>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <mutex>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
 
 #include <background_extractor.h>
+#include <job_runner.h>
+#include <streaming_background_extractor.h>
 
 namespace boost_po = boost::program_options;
 namespace bfs = boost::filesystem;
@@ -18,15 +25,132 @@ namespace bfs = boost::filesystem;
 using Params = BackgroundExtractor::ProcessingParams;
 using DisplayCb = std::function<void()>;
 
+const std::string dataset_preset_filename = "background_extraction.cfg";
+
 struct Config
 {
-    std::string images_dir_path_;
+    std::vector<std::string> images_dir_paths_;
     std::string images_extension;
     std::string output_dir_path_;
+    std::string preset_path_;
 
     float resize_factor_;
+    float refine_factor_;
+    bool batch_;
+    bool vote_;
+    std::string order_;
+    bool streaming_;
+    int blur_cache_mb_;
+    std::string disk_cache_dir_path_;
+    int disk_cache_mb_;
+    int integral_mb_;
+    int num_threads_;
+    int tile_size_;
+    int feather_radius_;
+    bool profile_;
+    int num_jobs_;
+    int memory_budget_mb_;
+
+    std::string video_path_;
+    int window_size_;
+    int output_period_;
+
+    Params params_ = Params(11, 10, 0, 0);
+    Params cmd_line_params_ = params_;              ///< Parameters as given on the command line
+    std::vector<std::string> cmd_line_param_names_; ///< Parameters set explicitly on the command line
 };
 
+/// @brief Describes the processing parameters, so that they can be read from the command line and from preset files
+/// @param params Parameters to fill, or nullptr to only describe the options without storing them
+boost_po::options_description make_params_options(Params *params)
+{
+    boost_po::options_description params_options("Processing parameters (also accepted in preset files)");
+    if (params)
+    {
+        // clang-format off
+        params_options.add_options()
+            ("blur", boost_po::value<int>(&params->blur_radius)->default_value(params->blur_radius), "Blurring kernel radius.")
+            ("ths", boost_po::value<int>(&params->ths)->default_value(params->ths), "Grayscale threshold in [0,255].")
+            ("open", boost_po::value<int>(&params->open_radius)->default_value(params->open_radius), "Kernel radius of the morphological opening.")
+            ("erosions", boost_po::value<int>(&params->num_final_erosions)->default_value(params->num_final_erosions),
+                                                              "Number of 5x5 erosions applied at the end.")
+            ;
+        // clang-format on
+    }
+    else
+    {
+        // clang-format off
+        params_options.add_options()
+            ("blur", boost_po::value<int>())
+            ("ths", boost_po::value<int>())
+            ("open", boost_po::value<int>())
+            ("erosions", boost_po::value<int>())
+            ;
+        // clang-format on
+    }
+    return params_options;
+}
+
+/// @brief Overwrites the parameters that are set in a preset file
+/// @param preset_path Path to a file made of "key = value" lines (blur, ths, open, erosions)
+/// @param params Parameters to update
+/// @return true if the file has been correctly parsed
+bool load_preset(const std::string &preset_path, Params &params)
+{
+    boost_po::variables_map vm;
+    try
+    {
+        boost_po::store(boost_po::parse_config_file<char>(preset_path.c_str(), make_params_options(nullptr)), vm);
+        boost_po::notify(vm);
+    }
+    catch (boost_po::error &e)
+    {
+        std::cerr << "Unable to parse preset " << preset_path << ": " << e.what() << std::endl;
+        return false;
+    }
+
+    if (vm.count("blur"))
+        params.blur_radius = vm["blur"].as<int>();
+    if (vm.count("ths"))
+        params.ths = vm["ths"].as<int>();
+    if (vm.count("open"))
+        params.open_radius = vm["open"].as<int>();
+    if (vm.count("erosions"))
+        params.num_final_erosions = vm["erosions"].as<int>();
+    return true;
+}
+
+/// @brief Overwrites the parameters with the ones set explicitly on the command line, which take precedence over
+/// all the preset files
+void apply_cmd_line_params(const Config &config, Params &params)
+{
+    for (const auto &name : config.cmd_line_param_names_)
+    {
+        if (name == "blur")
+            params.blur_radius = config.cmd_line_params_.blur_radius;
+        else if (name == "ths")
+            params.ths = config.cmd_line_params_.ths;
+        else if (name == "open")
+            params.open_radius = config.cmd_line_params_.open_radius;
+        else if (name == "erosions")
+            params.num_final_erosions = config.cmd_line_params_.num_final_erosions;
+    }
+}
+
+/// @brief Gets the parameters of a dataset, from its own preset file if there's one
+/// @return false if its preset file couldn't be parsed
+bool load_dataset_params(const Config &config, const std::string &images_dir_path, Params &params)
+{
+    params = config.params_;
+    const bfs::path dataset_preset_path = bfs::path(images_dir_path) / dataset_preset_filename;
+    if (!bfs::exists(dataset_preset_path))
+        return true;
+    if (!load_preset(dataset_preset_path.string(), params))
+        return false;
+    apply_cmd_line_params(config, params);
+    return true;
+}
+
 /// @brief Utility function to parse command line attributes
 bool parse_command_line(int argc, char *argv[], Config &config)
 {
@@ -42,16 +166,58 @@ bool parse_command_line(int argc, char *argv[], Config &config)
         "Once the red areas correspond to the areas to remove, press any key.\n"
         "Then, the final image appears on the side, made of the pixels coming from\n"
         "the green areas.\n"
-        "Repeat this step until the final image is entirely filled.\n");
+        "Repeat this step until the final image is entirely filled.\n"
+        "\nIn batch mode, no window is opened: each input directory is processed\n"
+        "with fixed parameters until the final image is filled or there are no\n"
+        "images left. Parameters are read from the preset file, then from a\n"
+        "'" + dataset_preset_filename + "' file inside each input directory, which\n"
+        "overrides it. Values given explicitly on the command line take precedence\n"
+        "over both files.\n");
 
     boost_po::options_description options_desc;
     boost_po::options_description base_options("Base options");
     // clang-format off
     base_options.add_options()
         ("help,h", "Produce help message.")
-        ("images_dir,i", boost_po::value<std::string>(&config.images_dir_path_), "Path to the directory containing the images.")
+        ("images_dir,i", boost_po::value<std::vector<std::string>>(&config.images_dir_paths_)->multitoken(),
+                                                              "Path to the directories containing the images.")
         ("images-extension,e", boost_po::value<std::string>(&config.images_extension), "Extension of the images ('png', 'JPG' ...).")
         ("resize,r", boost_po::value<float>(&config.resize_factor_)->default_value(1.0), "Resize factor used internally to work on smaller images.")
+        ("refine", boost_po::value<float>(&config.refine_factor_)->default_value(0.f),
+                                                              "Resize factor at which masks are refined around their edges when finalized (0 to disable).")
+        ("batch,b", boost_po::bool_switch(&config.batch_), "Process all the directories without GUI, using fixed parameters.")
+        ("vote,a", boost_po::bool_switch(&config.vote_),
+                                                              "Automatically select each pixel from the image agreeing with the most other images (only uses --blur).")
+        ("order", boost_po::value<std::string>(&config.order_)->default_value("file"),
+                                                              "Order of the reference images: 'file', 'coverage' (fewest passes) or 'compare' (batch only, runs both and reports the difference).")
+        ("preset,p", boost_po::value<std::string>(&config.preset_path_), "Path to a preset file containing processing parameters.")
+        ("streaming,s", boost_po::bool_switch(&config.streaming_),
+                                                              "Only keep downsampled images in memory, and decode full-resolution ones when needed.")
+        ("threads,t", boost_po::value<int>(&config.num_threads_)->default_value(0), "Number of threads (0 to use all the cores).")
+        ("tile-size", boost_po::value<int>(&config.tile_size_)->default_value(0),
+                                                              "Process the images by square tiles of this size (0 to disable), to bound memory use.")
+        ("feather", boost_po::value<int>(&config.feather_radius_)->default_value(0),
+                                                              "Radius (in resized pixels) within which source images are blended at their boundaries in the final image.")
+        ("blur-cache", boost_po::value<int>(&config.blur_cache_mb_)->default_value(1024), "Memory budget (MB) of the blurred images cache.")
+        ("disk-cache", boost_po::value<std::string>(&config.disk_cache_dir_path_),
+                                                              "Directory where resized images are cached, to reload datasets without decoding them.")
+        ("disk-cache-size", boost_po::value<int>(&config.disk_cache_mb_)->default_value(8192), "Maximum size (MB) of the disk cache.")
+        ("integral", boost_po::value<int>(&config.integral_mb_)->default_value(2048),
+                                                              "Memory budget (MB) of the summed-area tables used to blur images.")
+        ("jobs,j", boost_po::value<int>(&config.num_jobs_)->default_value(1),
+                                                              "Maximum number of directories processed at the same time in batch mode, sharing the threads.")
+        ("memory-budget", boost_po::value<int>(&config.memory_budget_mb_)->default_value(8192),
+                                                              "Memory budget (MB) of the directories processed at the same time.")
+        ;
+    // clang-format on
+
+    boost_po::options_description video_options("Video options");
+    // clang-format off
+    video_options.add_options()
+        ("video,v", boost_po::value<std::string>(&config.video_path_),
+                                                              "Video file or image sequence (e.g. 'img_%04d.jpg') of a fixed camera, used instead of the images directories.")
+        ("window", boost_po::value<int>(&config.window_size_)->default_value(50), "Number of frames in the sliding window.")
+        ("period", boost_po::value<int>(&config.output_period_)->default_value(10), "Number of frames between two background images.")
         ;
     // clang-format on
 
@@ -60,10 +226,12 @@ bool parse_command_line(int argc, char *argv[], Config &config)
     output_options.add_options()
         ("out-dir,o", boost_po::value<std::string>(&config.output_dir_path_)->default_value("/tmp/background_extraction"),
                                                               "Path of the output directory used to save the final image.")
+        ("profile", boost_po::bool_switch(&config.profile_),
+                                                              "Write the timings of the processing stages and the memory use of each dataset to 'profile.json'.")
         ;
     // clang-format on
 
-    options_desc.add(base_options).add(output_options);
+    options_desc.add(base_options).add(make_params_options(&config.params_)).add(video_options).add(output_options);
 
     boost_po::variables_map vm;
     try
@@ -98,13 +266,57 @@ bool parse_command_line(int argc, char *argv[], Config &config)
             return false;
         }
     }
-    if (!bfs::exists(config.images_dir_path_))
+    if (!config.video_path_.empty())
     {
-        std::cerr << "The input image directory path doesn't exist: " << config.images_dir_path_ << std::endl;
+        if (config.window_size_ < 2 || config.window_size_ > std::numeric_limits<uint16_t>::max() || config.output_period_ < 1)
+        {
+            std::cerr << "The sliding window must contain at least two frames, and the period be positive." << std::endl;
+            return false;
+        }
+    }
+    else if (config.order_ != "file" && config.order_ != "coverage" && config.order_ != "compare")
+    {
+        std::cerr << "Unknown reference order: " << config.order_ << std::endl;
+        return false;
+    }
+    else if (config.order_ == "compare" && !config.batch_)
+    {
+        std::cerr << "Comparing reference orders requires the batch mode." << std::endl;
+        return false;
+    }
+    else if (config.num_jobs_ > 1 && ((!config.batch_ && !config.vote_) || config.order_ == "compare"))
+    {
+        std::cerr << "Processing several directories at the same time requires the batch or vote mode, without comparing orders." << std::endl;
         return false;
     }
+    else if (config.images_dir_paths_.empty())
+    {
+        std::cerr << "At least one input image directory or a video is required." << std::endl;
+        return false;
+    }
+    for (const auto &images_dir_path : config.images_dir_paths_)
+    {
+        if (!bfs::exists(images_dir_path))
+        {
+            std::cerr << "The input image directory path doesn't exist: " << images_dir_path << std::endl;
+            return false;
+        }
+    }
+
+    // Command line values take precedence over the ones of the preset files
+    config.cmd_line_params_ = config.params_;
+    for (const char *name : {"blur", "ths", "open", "erosions"})
+        if (!vm[name].defaulted())
+            config.cmd_line_param_names_.push_back(name);
+    if (!config.preset_path_.empty())
+    {
+        if (!load_preset(config.preset_path_, config.params_))
+            return false;
+        apply_cmd_line_params(config, config.params_);
+    }
 
-    std::cout << long_program_desc << std::endl;
+    if (!config.batch_ && !config.vote_ && config.video_path_.empty())
+        std::cout << long_program_desc << std::endl;
     return true;
 }
 
@@ -113,31 +325,54 @@ const int ths_max = 40;
 const int open_radius_max = 30;
 const int num_final_erosions_max = 30;
 
-Params params(11, 10, 0, 0);
-
-int main(int argc, char **argv)
+/// @brief Writes the stage timings and the memory use of the extractor as JSON in the output directory
+void write_profile(const BackgroundExtractor &extractor, const std::string &output_dir_path)
 {
-    Config config;
-    if (!parse_command_line(argc, argv, config))
-        return 1;
-
-    BackgroundExtractor extractor(config.resize_factor_);
-
-    std::cout << "Loading images ..." << std::endl;
-    extractor.load_images(config.images_dir_path_, config.images_extension);
-    std::cout << "Done." << std::endl;
+    const std::string write_path = (bfs::path(output_dir_path) / "profile.json").string();
+    std::ofstream file(write_path);
+    if (!file)
+    {
+        std::cerr << "Unable to write the profile " << write_path << std::endl;
+        return;
+    }
+    extractor.write_profile(file);
+    std::cout << "Profile has been written to " << write_path << std::endl;
+}
 
-    /////////////////
+/// @brief Writes the final image in the output directory, depending on the process status
+void write_final_image(BackgroundExtractor &extractor, BackgroundExtractor::Status status, const std::string &output_dir_path)
+{
+    if (status == BackgroundExtractor::Status::Success)
+    {
+        std::cout << " *** Success *** " << std::endl;
+        std::cout << "Enough images have been provided to recover the background." << std::endl;
+        const std::string write_path = (bfs::path(output_dir_path) / "extracted_background.png").string();
+        cv::imwrite(write_path, extractor.get_final_image());
+        std::cout << "Image has been written to " << write_path << std::endl;
+    }
+    else if (status == BackgroundExtractor::Status::Fail)
+    {
+        std::cout << " *** Fail *** " << std::endl;
+        std::cout << "Not enough images have been provided to recover the background." << std::endl;
+        const std::string write_path = (bfs::path(output_dir_path) / "failed_extracted_background.png").string();
+        cv::imwrite(write_path, extractor.get_final_image());
+        std::cout << "Partial image has been written to " << write_path << std::endl;
+    }
+}
 
+/// @brief Lets the user tune the parameters for each reference image through the GUI
+BackgroundExtractor::Status run_interactive(BackgroundExtractor &extractor, Params &params)
+{
     const std::string main_window_name = "Background Extraction";
     const std::string result_window_name = "Result";
     cv::namedWindow(main_window_name);
 
+    // Trackbars only request an update, and the mask is displayed once it's ready, so that dragging them doesn't
+    // freeze the GUI
+    bool mask_pending = false;
     DisplayCb display_mask_cb = [&]() {
-        extractor.update_mask(params);
-        static cv::Mat disp_img;
-        extractor.get_overlayed_reference_img(disp_img);
-        cv::imshow(main_window_name, disp_img);
+        extractor.request_mask_update(params);
+        mask_pending = true;
     };
 
     auto param_cb = [](int, void *display_cb_ptr) {
@@ -150,34 +385,292 @@ int main(int argc, char **argv)
     cv::createTrackbar("Eroding at the end", main_window_name, &params.num_final_erosions, num_final_erosions_max, param_cb, &display_mask_cb);
 
     cv::Mat disp_final_img;
-    while (true)
+    auto status = BackgroundExtractor::Status::Continue;
+    cv::Mat disp_img;
+    while (status == BackgroundExtractor::Status::Continue)
     {
         display_mask_cb();
-        cv::waitKey(0);
-        const auto status = extractor.finalize_mask();
+        bool key_pressed = false;
+        while (mask_pending || !key_pressed)
+        {
+            if (mask_pending && extractor.poll_mask_update())
+            {
+                extractor.get_overlayed_reference_img(disp_img);
+                cv::imshow(main_window_name, disp_img);
+                mask_pending = false;
+            }
+            if (cv::waitKey(20) >= 0)
+                key_pressed = true;
+        }
+        status = extractor.finalize_mask();
         const auto &final_img = extractor.get_final_image();
         cv::resize(final_img, disp_final_img, cv::Size(800, (800 * final_img.rows) / final_img.cols));
         cv::imshow(result_window_name, disp_final_img);
         cv::waitKey(1);
+    }
+
+    // Trackbars refer to this function's callback
+    cv::destroyAllWindows();
+    return status;
+}
+
+/// @brief Uses the same parameters for all the reference images, without any window
+/// @param num_passes Number of reference images that have been needed
+BackgroundExtractor::Status run_batch(BackgroundExtractor &extractor, const Params &params, int &num_passes)
+{
+    num_passes = 0;
+    auto status = BackgroundExtractor::Status::Continue;
+    while (status == BackgroundExtractor::Status::Continue)
+    {
+        extractor.update_mask(params);
+        status = extractor.finalize_mask();
+        num_passes++;
+    }
+    return status;
+}
+
+/// @brief Runs the batch mode with the file order, then with the coverage order, and reports the number of passes
+/// and the processing time of both
+/// @note Timings include the loading step, since the coverage order is estimated there
+BackgroundExtractor::Status compare_reference_orders(BackgroundExtractor &extractor, const Params &params,
+                                                     const std::string &images_dir_path, const std::string &images_extension)
+{
+    int num_passes[2];
+    double elapsed_s[2];
+    auto status = BackgroundExtractor::Status::Fail;
+    const BackgroundExtractor::ReferenceOrder orders[2] = {BackgroundExtractor::ReferenceOrder::FileOrder,
+                                                           BackgroundExtractor::ReferenceOrder::Coverage};
+    for (int k = 0; k < 2; k++)
+    {
+        extractor.set_reference_order(orders[k], params.blur_radius);
+        const auto start_time = std::chrono::steady_clock::now();
+        if (!extractor.load_images(images_dir_path, images_extension))
+            return BackgroundExtractor::Status::Fail;
+        status = run_batch(extractor, params, num_passes[k]);
+        elapsed_s[k] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    }
+
+    std::cout << "File order:     " << num_passes[0] << " passes, " << elapsed_s[0] << " s" << std::endl;
+    std::cout << "Coverage order: " << num_passes[1] << " passes, " << elapsed_s[1] << " s" << std::endl;
+    std::cout << "Saved " << num_passes[0] - num_passes[1] << " passes and " << elapsed_s[0] - elapsed_s[1] << " s" << std::endl;
+    return status;
+}
+
+/// @brief Writes a background image every output period, while reading the video
+/// @return true if the video has been correctly opened
+bool run_video(const Config &config)
+{
+    StreamingBackgroundExtractor extractor(config.window_size_, config.output_period_, config.resize_factor_,
+                                           config.params_.blur_radius);
+    extractor.set_num_threads(config.num_threads_);
+    if (!extractor.open(config.video_path_))
+        return false;
+
+    const std::string window_name = "Background";
+    const auto start_time = std::chrono::steady_clock::now();
+    int num_backgrounds = 0;
+    bool new_background;
+    while (extractor.read_next_frame(new_background))
+    {
+        if (!new_background)
+            continue;
+
+        char filename[32];
+        snprintf(filename, sizeof(filename), "background_%05d.png", num_backgrounds++);
+        cv::imwrite((bfs::path(config.output_dir_path_) / filename).string(), extractor.get_background());
+        if (!config.batch_)
+        {
+            cv::imshow(window_name, extractor.get_background());
+            cv::waitKey(1);
+        }
+    }
+    if (!config.batch_)
+        cv::destroyAllWindows();
+
+    const double elapsed_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    std::cout << extractor.get_num_frames() << " frames processed in " << elapsed_s << " s ("
+              << (elapsed_s > 0 ? extractor.get_num_frames() / elapsed_s : 0.) << " frames/s). " << num_backgrounds
+              << " background images have been written to " << config.output_dir_path_ << std::endl;
+    return true;
+}
+
+/// @brief Applies the settings of the command line to an extractor
+void configure_extractor(const Config &config, BackgroundExtractor &extractor)
+{
+    extractor.set_streaming(config.streaming_);
+    extractor.set_tile_size(config.tile_size_);
+    extractor.set_feathering(config.feather_radius_);
+    extractor.set_refinement(config.refine_factor_);
+    extractor.set_blur_cache_size(size_t(config.blur_cache_mb_) << 20);
+    extractor.set_disk_cache(config.disk_cache_dir_path_, size_t(config.disk_cache_mb_) << 20);
+    extractor.set_integral_images(blur_radius_max, size_t(config.integral_mb_) << 20);
+}
+
+/// @brief Gets the name of the last directory of a path, ignoring trailing separators (e.g. "images/Test1/")
+std::string get_dir_name(const std::string &dir_path)
+{
+    bfs::path path = bfs::absolute(dir_path);
+    while (!path.empty() && (path.filename().empty() || path.filename() == "." || path.filename() == "/"))
+        path = path.parent_path();
+    return path.empty() ? "dataset" : path.filename().string();
+}
+
+/// @brief Gets the output directory of a dataset, creating it if needed
+std::string get_output_dir_path(const Config &config, const std::string &images_dir_path)
+{
+    std::string output_dir_path = config.output_dir_path_;
+    if (config.images_dir_paths_.size() > 1)
+    {
+        // Avoid overwriting the results of the other datasets. Datasets sharing the same directory name (e.g.
+        // "a/Test1" and "b/Test1") are told apart by their position on the command line
+        const std::string dir_name = get_dir_name(images_dir_path);
+        int dataset_id = -1;
+        int num_same_names = 0;
+        for (int i = 0; i < int(config.images_dir_paths_.size()); i++)
+        {
+            if (get_dir_name(config.images_dir_paths_[i]) != dir_name)
+                continue;
+            num_same_names++;
+            if (dataset_id < 0 && config.images_dir_paths_[i] == images_dir_path)
+                dataset_id = i;
+        }
+        const std::string output_name = num_same_names > 1 ? dir_name + "_" + std::to_string(dataset_id) : dir_name;
+        output_dir_path = (bfs::path(output_dir_path) / output_name).string();
+        bfs::create_directories(output_dir_path);
+    }
+    return output_dir_path;
+}
+
+/// @brief Processes several directories at the same time, sharing the threads and a memory budget
+/// @return Number of directories that haven't been fully recovered
+int run_job_queue(const Config &config, int &num_processed_images)
+{
+    JobRunner runner(config.resize_factor_, config.num_threads_, config.num_jobs_, size_t(config.memory_budget_mb_) << 20);
+    int num_failed_datasets = 0;
+    for (const auto &images_dir_path : config.images_dir_paths_)
+    {
+        JobRunner::Job job(images_dir_path, config.images_extension, config.params_);
+        job.vote = config.vote_;
+        if (!load_dataset_params(config, images_dir_path, job.params))
+        {
+            num_failed_datasets++;
+            continue;
+        }
+        runner.add_job(job);
+    }
+
+    runner.set_setup_callback([&config](const JobRunner::Job &job, BackgroundExtractor &extractor) {
+        configure_extractor(config, extractor);
+        extractor.set_reference_order(config.order_ == "coverage" ? BackgroundExtractor::ReferenceOrder::Coverage
+                                                                  : BackgroundExtractor::ReferenceOrder::FileOrder,
+                                      job.params.blur_radius);
+        extractor.set_profiling(config.profile_);
+    });
+
+    // Jobs finish on different threads
+    std::mutex output_mutex;
+    runner.set_done_callback([&](const JobRunner::Job &job, BackgroundExtractor &extractor, const JobRunner::Result &result) {
+        std::lock_guard<std::mutex> lock(output_mutex);
+        std::cout << job.images_dir_path << ": " << result.num_images << " images, " << result.num_passes << " passes, "
+                  << result.elapsed_s << " s" << std::endl;
+        if (!result.loaded)
+            return;
+        const std::string output_dir_path = get_output_dir_path(config, job.images_dir_path);
+        write_final_image(extractor, result.status, output_dir_path);
+        if (config.profile_)
+            write_profile(extractor, output_dir_path);
+    });
+
+    for (const auto &result : runner.run())
+    {
+        if (!result.loaded || result.status != BackgroundExtractor::Status::Success)
+            num_failed_datasets++;
+        num_processed_images += result.num_images;
+    }
+    return num_failed_datasets;
+}
+
+/// @brief Processes the directories one after the other, reusing the same extractor
+/// @return Number of directories that haven't been fully recovered
+int run_datasets(const Config &config, int &num_processed_images)
+{
+    BackgroundExtractor extractor(config.resize_factor_, std::make_shared<ThreadPool>(config.num_threads_));
+    configure_extractor(config, extractor);
+
+    int num_failed_datasets = 0;
+    for (const auto &images_dir_path : config.images_dir_paths_)
+    {
+        Params params = config.params_;
+        if (!load_dataset_params(config, images_dir_path, params))
+        {
+            num_failed_datasets++;
+            continue;
+        }
 
-        if (status == BackgroundExtractor::Status::Success)
+        const std::string output_dir_path = get_output_dir_path(config, images_dir_path);
+
+        // Measurements are cleared for each dataset
+        extractor.set_profiling(config.profile_);
+
+        if (config.order_ == "compare")
         {
-            std::cout << " *** Success *** " << std::endl;
-            std::cout << "Enough images have been provided to recover the background." << std::endl;
-            const std::string write_path = (bfs::path(config.output_dir_path_) / "extracted_background.png").string();
-            cv::imwrite(write_path, extractor.get_final_image());
-            std::cout << "Image has been written to " << write_path << std::endl;
-            break;
+            std::cout << "Comparing reference orders on " << images_dir_path << " ..." << std::endl;
+            const auto status = compare_reference_orders(extractor, params, images_dir_path, config.images_extension);
+            write_final_image(extractor, status, output_dir_path);
+            if (config.profile_)
+                write_profile(extractor, output_dir_path);
+            if (status != BackgroundExtractor::Status::Success)
+                num_failed_datasets++;
+            num_processed_images += 2 * extractor.get_num_images();
+            continue;
         }
-        else if (status == BackgroundExtractor::Status::Fail)
+
+        std::cout << "Loading images from " << images_dir_path << " ..." << std::endl;
+        extractor.set_reference_order(config.order_ == "coverage" ? BackgroundExtractor::ReferenceOrder::Coverage
+                                                                  : BackgroundExtractor::ReferenceOrder::FileOrder,
+                                      params.blur_radius);
+        if (!extractor.load_images(images_dir_path, config.images_extension))
         {
-            std::cout << " *** Fail *** " << std::endl;
-            std::cout << "Not enough images have been provided to recover the background." << std::endl;
-            const std::string write_path = (bfs::path(config.output_dir_path_) / "failed_extracted_background.png").string();
-            cv::imwrite(write_path, extractor.get_final_image());
-            std::cout << "Partial image has been written to " << write_path << std::endl;
+            num_failed_datasets++;
+            continue;
         }
+        if (extractor.is_loaded_from_disk_cache())
+            std::cout << "Working images have been loaded from the disk cache" << std::endl;
+        std::cout << "Done. Summed-area tables use " << (extractor.get_integral_images_num_bytes() >> 20) << " MB." << std::endl;
+
+        BackgroundExtractor::Status status;
+        int num_passes;
+        if (config.vote_)
+            status = extractor.vote_final_image(params.blur_radius);
+        else
+            status = config.batch_ ? run_batch(extractor, params, num_passes) : run_interactive(extractor, params);
+        write_final_image(extractor, status, output_dir_path);
+        if (config.profile_)
+            write_profile(extractor, output_dir_path);
+        if (status != BackgroundExtractor::Status::Success)
+            num_failed_datasets++;
+        num_processed_images += extractor.get_num_images();
     }
+    return num_failed_datasets;
+}
+
+int main(int argc, char **argv)
+{
+    Config config;
+    if (!parse_command_line(argc, argv, config))
+        return 1;
+
+    if (!config.video_path_.empty())
+        return run_video(config) ? 0 : 1;
+
+    const auto start_time = std::chrono::steady_clock::now();
+    int num_processed_images = 0;
+    const int num_failed_datasets = config.num_jobs_ > 1 ? run_job_queue(config, num_processed_images)
+                                                         : run_datasets(config, num_processed_images);
+
+    const double elapsed_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    std::cout << num_processed_images << " images from " << config.images_dir_paths_.size() << " directories processed in "
+              << elapsed_s << " s (" << (elapsed_s > 0 ? num_processed_images / elapsed_s : 0.) << " images/s)." << std::endl;
 
-    return 0;
+    return num_failed_datasets == 0 ? 0 : 1;
 }
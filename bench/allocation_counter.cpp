@@ -0,0 +1,101 @@
+/*********************************************************************************************************************
+ * File : allocation_counter.cpp                                                                                     *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <opencv2/core.hpp>
+
+#include "allocation_counter.h"
+
+namespace
+{
+std::atomic<bool> counting(false);
+std::atomic<size_t> num_allocations(0);
+
+void count_allocation()
+{
+    if (counting.load(std::memory_order_relaxed))
+        num_allocations++;
+}
+
+#if CV_VERSION_MAJOR >= 4
+using AccessFlag = cv::AccessFlag;
+#else
+using AccessFlag = int;
+#endif
+
+/// @brief Forwards to the default allocator of cv::Mat, counting the buffers it allocates
+/// @note Buffers keep a pointer to the default allocator, which releases them
+class CountingMatAllocator : public cv::MatAllocator
+{
+public:
+    explicit CountingMatAllocator(cv::MatAllocator *allocator) : allocator_(allocator) {}
+
+    cv::UMatData *allocate(int dims, const int *sizes, int type, void *data, size_t *step, AccessFlag flags,
+                           cv::UMatUsageFlags usage_flags) const override
+    {
+        if (!data)
+            count_allocation();
+        return allocator_->allocate(dims, sizes, type, data, step, flags, usage_flags);
+    }
+
+    bool allocate(cv::UMatData *data, AccessFlag access_flags, cv::UMatUsageFlags usage_flags) const override
+    {
+        return allocator_->allocate(data, access_flags, usage_flags);
+    }
+
+    void deallocate(cv::UMatData *data) const override
+    {
+        allocator_->deallocate(data);
+    }
+
+private:
+    cv::MatAllocator *allocator_;
+};
+
+CountingMatAllocator *mat_allocator = nullptr;
+} // namespace
+
+void *operator new(size_t size)
+{
+    count_allocation();
+    void *ptr = std::malloc(size == 0 ? 1 : size);
+    if (!ptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void start_counting_allocations()
+{
+    if (!mat_allocator)
+        mat_allocator = new CountingMatAllocator(cv::Mat::getStdAllocator());
+    cv::Mat::setDefaultAllocator(mat_allocator);
+    num_allocations = 0;
+    counting = true;
+}
+
+size_t stop_counting_allocations()
+{
+    counting = false;
+    cv::Mat::setDefaultAllocator(nullptr);
+    return num_allocations;
+}
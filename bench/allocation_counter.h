@@ -0,0 +1,22 @@
+/*********************************************************************************************************************
+ * File : allocation_counter.h                                                                                       *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#ifndef ALLOCATION_COUNTER_H
+#define ALLOCATION_COUNTER_H
+
+#include <cstddef>
+
+/// @brief Starts counting the heap allocations of all the threads, i.e. the calls to operator new and the buffers
+/// allocated by cv::Mat
+/// @note Buffers allocated internally by OpenCV functions with cv::fastMalloc (e.g. the rows of cv::blur, or
+/// cv::AutoBuffer) bypass both operator new and the cv::Mat allocator, so they aren't counted
+void start_counting_allocations();
+
+/// @brief Stops counting the heap allocations
+/// @return Number of allocations since start_counting_allocations
+size_t stop_counting_allocations();
+
+#endif // ALLOCATION_COUNTER_H
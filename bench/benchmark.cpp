@@ -0,0 +1,535 @@
+/*********************************************************************************************************************
+ * File : benchmark.cpp                                                                                              *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include <background_extractor.h>
+#include <diff_kernel.h>
+#include <integral_image.h>
+#include <mask_morphology.h>
+
+#include "allocation_counter.h"
+#include "synthetic_burst.h"
+
+namespace boost_po = boost::program_options;
+namespace bfs = boost::filesystem;
+
+using Params = BackgroundExtractor::ProcessingParams;
+using Clock = std::chrono::steady_clock;
+
+/// Largest fraction of the mask pixels where the distance map opening may differ from cv::erode and cv::dilate, for
+/// radii larger than 1. The final erosions, and the openings of radius 0 or 1, must match exactly
+const double morphology_max_mismatch_tolerance = 0.05;
+
+struct BenchConfig
+{
+    std::vector<std::string> images_dir_paths_;
+    std::string images_extension_;
+    std::vector<std::string> synthetic_sizes_;
+    SyntheticBurstParams synthetic_params_;
+    std::string output_path_;
+
+    float resize_factor_;
+    int num_threads_;
+    int blur_cache_mb_;
+    int num_repeats_;
+    bool verify_;
+    bool check_allocations_;
+
+    Params params_ = Params(11, 10, 5, 2);
+};
+
+/// @brief Timings of a dataset, in milliseconds, and results of the optional checks
+struct DatasetResult
+{
+    std::string name;
+    int num_images = 0;
+    cv::Size original_size;
+    std::map<std::string, std::vector<double>> timings_ms; ///< Samples of each measured step
+    std::vector<std::pair<std::string, size_t>> buffers_bytes; ///< Memory of the extractor buffers once the mask is computed
+    size_t peak_rss_bytes = 0;                                 ///< Peak resident memory of the process after the dataset
+
+    double morphology_max_mismatch = -1; ///< Largest fraction of mask pixels where the engines differ
+    int morphology_exact_mismatches = 0; ///< Differing pixels in the cases where the engines must match exactly
+    int steady_state_allocations = -1;   ///< Heap allocations while the parameters change, or -1 if not checked
+};
+
+/// @brief Results of the checks of the optimized kernels against OpenCV
+struct CheckResults
+{
+    int kernel_mismatches = 0; ///< Pixels where the fused diff kernel differs from OpenCV
+    int blur_mismatches = 0;   ///< Values where the blur derived from summed-area tables differs from cv::blur
+    double morphology_max_mismatch = 0; ///< Largest fraction of mask pixels where the morphology engines differ
+    int morphology_exact_mismatches = 0; ///< Differing pixels in the cases where the engines must match exactly
+};
+
+double get_elapsed_ms(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+/// @brief Parses "4k", "8k" or "<width>x<height>"
+bool parse_size(const std::string &str, cv::Size &size)
+{
+    if (str == "4k" || str == "4K")
+        size = cv::Size(3840, 2160);
+    else if (str == "8k" || str == "8K")
+        size = cv::Size(7680, 4320);
+    else if (sscanf(str.c_str(), "%dx%d", &size.width, &size.height) != 2 || size.width <= 0 || size.height <= 0)
+        return false;
+    return true;
+}
+
+/// @brief Compares the fused diff kernel against cv::absdiff, cv::cvtColor and a per-pixel minimum
+/// @param width Width of the random images
+/// @return Number of pixels where the minimum or the matched ID differ
+int count_kernel_mismatches(int seed, int width)
+{
+    cv::RNG rng(seed);
+    const int height = 64;
+    cv::Mat ref(height, width, CV_8UC3), img(height, width, CV_8UC3);
+    rng.fill(ref, cv::RNG::UNIFORM, cv::Scalar::all(0), cv::Scalar::all(256));
+    rng.fill(img, cv::RNG::UNIFORM, cv::Scalar::all(0), cv::Scalar::all(256));
+    cv::Mat_<uint8_t> min_diff(height, width);
+    rng.fill(min_diff, cv::RNG::UNIFORM, cv::Scalar::all(0), cv::Scalar::all(256));
+    cv::Mat_<uint16_t> best_match_ids(height, width, uint16_t(0));
+
+    cv::Mat diff, gray_diff;
+    cv::absdiff(ref, img, diff);
+    cv::cvtColor(diff, gray_diff, cv::COLOR_BGR2GRAY);
+    cv::Mat_<uint8_t> expected_min_diff;
+    cv::min(min_diff, gray_diff, expected_min_diff);
+
+    const uint16_t img_id = 1;
+    int num_mismatches = 0;
+    for (int y = 0; y < height; y++)
+    {
+        const cv::Mat_<uint8_t> initial_min_diff = min_diff.row(y).clone();
+        update_min_gray_absdiff(ref.ptr<uint8_t>(y), img.ptr<uint8_t>(y), width, img_id, min_diff[y], best_match_ids[y]);
+        for (int x = 0; x < width; x++)
+        {
+            const uint16_t expected_id = gray_diff.at<uint8_t>(y, x) < initial_min_diff(0, x) ? img_id : 0;
+            if (min_diff(y, x) != expected_min_diff(y, x) || best_match_ids(y, x) != expected_id)
+                num_mismatches++;
+        }
+    }
+    return num_mismatches;
+}
+
+/// @brief Compares the box blur derived from summed-area tables against cv::blur, for all the radii they support
+/// @return Number of values that differ
+int count_blur_mismatches(int seed, int max_blur_radius)
+{
+    cv::RNG rng(seed);
+    cv::Mat img(2 * max_blur_radius + 37, 2 * max_blur_radius + 51, CV_8UC3);
+    rng.fill(img, cv::RNG::UNIFORM, cv::Scalar::all(0), cv::Scalar::all(256));
+    IntegralImage integral_img;
+    integral_img.compute(img, max_blur_radius);
+
+    int num_mismatches = 0;
+    cv::Mat blurred_img, expected_blurred_img, diff;
+    for (int blur_radius = 0; blur_radius <= max_blur_radius; blur_radius++)
+    {
+        integral_img.box_blur(blur_radius, blurred_img);
+        cv::blur(img, expected_blurred_img, cv::Size(2 * blur_radius + 1, 2 * blur_radius + 1));
+        cv::compare(blurred_img, expected_blurred_img, diff, cv::CMP_NE);
+        num_mismatches += cv::countNonZero(diff.reshape(1));
+    }
+    return num_mismatches;
+}
+
+/// @brief Compares the distance map engine against the kernel engine on a mask
+/// @param num_exact_mismatches Number of differing pixels with an opening radius of 0 or 1, where the engines must
+/// match exactly
+/// @return Largest fraction of mask pixels where they differ, over several opening radii and numbers of erosions
+double get_morphology_max_mismatch(const cv::Mat_<uint8_t> &mask, int &num_exact_mismatches)
+{
+    ThreadPool pool;
+    MaskMorphology kernel_morphology, distance_map_morphology;
+    kernel_morphology.set_engine(MaskMorphology::Kernel);
+    distance_map_morphology.set_engine(MaskMorphology::DistanceMap);
+    kernel_morphology.set_mask(mask);
+    distance_map_morphology.set_mask(mask);
+
+    const int num_mask_pixels = std::max(1, cv::countNonZero(mask));
+    double max_mismatch = 0;
+    num_exact_mismatches = 0;
+    cv::Mat_<uint8_t> kernel_dst, distance_map_dst, diff;
+    for (int open_radius : {0, 1, 2, 3, 5, 8, 12})
+    {
+        for (int num_final_erosions : {0, 1, 3, 6})
+        {
+            kernel_morphology.apply(pool, open_radius, num_final_erosions, kernel_dst);
+            distance_map_morphology.apply(pool, open_radius, num_final_erosions, distance_map_dst);
+            cv::compare(kernel_dst, distance_map_dst, diff, cv::CMP_NE);
+            const int num_mismatches = cv::countNonZero(diff);
+            if (open_radius <= 1)
+                num_exact_mismatches += num_mismatches;
+            max_mismatch = std::max(max_mismatch, double(num_mismatches) / num_mask_pixels);
+        }
+    }
+    return max_mismatch;
+}
+
+/// @brief Runs the checks of the optimized kernels, which don't depend on the datasets
+CheckResults run_checks(int seed)
+{
+    CheckResults results;
+
+    // Widths that aren't multiples of the vector width also check the scalar tail
+    for (int width : {1, 15, 16, 17, 1037})
+        results.kernel_mismatches += count_kernel_mismatches(seed, width);
+
+    // Same largest radius as the extractor
+    results.blur_mismatches = count_blur_mismatches(seed, 30);
+
+    // Blobs of about ten pixels, noisier than most selection masks
+    cv::RNG rng(seed);
+    cv::Mat_<float> noise(240, 320);
+    rng.fill(noise, cv::RNG::UNIFORM, cv::Scalar::all(0), cv::Scalar::all(1));
+    cv::GaussianBlur(noise, noise, cv::Size(0, 0), 4);
+    cv::Mat_<uint8_t> mask;
+    cv::compare(noise, 0.5, mask, cv::CMP_GT);
+    results.morphology_max_mismatch = get_morphology_max_mismatch(mask, results.morphology_exact_mismatches);
+    return results;
+}
+
+/// @brief Counts the heap allocations of update_mask and of the overlay while the parameters change, once each
+/// combination of parameters has been processed once
+int count_steady_state_allocations(BackgroundExtractor &extractor, const Params &initial_params)
+{
+    cv::Mat overlay;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        // The first pass is the warm-up
+        if (pass > 0)
+            start_counting_allocations();
+
+        // Move one slider at a time, like in the GUI
+        Params params = initial_params;
+        for (int k = 0; k < 16; k++)
+        {
+            const int bit = k % 4;
+            if (bit == 0)
+                params.blur_radius += (k / 4) % 2 ? -1 : 1;
+            else if (bit == 1)
+                params.ths += (k / 4) % 2 ? -1 : 1;
+            else if (bit == 2)
+                params.open_radius += (k / 4) % 2 ? -1 : 1;
+            else
+                params.num_final_erosions += (k / 4) % 2 ? -1 : 1;
+            extractor.update_mask(params);
+            extractor.get_overlayed_reference_img(overlay);
+        }
+    }
+    return int(stop_counting_allocations());
+}
+
+/// @brief Times each step of the extraction on a dataset
+///
+/// The stages of update_mask are read from the profiler of the extractor, since each of them reuses a different part
+/// of the previous results. Blur radii alternate so that each sample runs all of them.
+DatasetResult run_dataset(const std::string &name, const std::string &dir_path, const std::string &extension,
+                          const BenchConfig &config)
+{
+    DatasetResult result;
+    result.name = name;
+
+    BackgroundExtractor extractor(config.resize_factor_, std::make_shared<ThreadPool>(config.num_threads_));
+    extractor.set_blur_cache_size(size_t(config.blur_cache_mb_) << 20);
+    extractor.set_profiling(true);
+    const Profiler &profiler = extractor.get_profiler();
+    const std::pair<Profiler::Stage, const char *> update_stages[] = {{Profiler::Blur, "blur"},
+                                                                       {Profiler::Diff, "diff"},
+                                                                       {Profiler::Threshold, "threshold"},
+                                                                       {Profiler::Morphology, "morphology"},
+                                                                       {Profiler::TiledDiff, "tiled_diff"},
+                                                                       {Profiler::TiledUpdate, "tiled_update"}};
+
+    for (int r = 0; r < config.num_repeats_; r++)
+    {
+        const auto start = Clock::now();
+        if (!extractor.load_images(dir_path, extension))
+            return result;
+        result.timings_ms["load_images"].push_back(get_elapsed_ms(start));
+    }
+    result.num_images = extractor.get_num_images();
+    result.original_size = extractor.get_original_size();
+
+    cv::Mat overlay;
+    for (int r = 0; r < config.num_repeats_; r++)
+    {
+        Params params = config.params_;
+        params.blur_radius += r % 2;
+
+        std::vector<std::pair<int, double>> stats_before;
+        for (const auto &stage : update_stages)
+            stats_before.emplace_back(profiler.get_count(stage.first), profiler.get_total_ms(stage.first));
+        auto start = Clock::now();
+        extractor.update_mask(params);
+        result.timings_ms["update_mask"].push_back(get_elapsed_ms(start));
+
+        // Stages that haven't been run (e.g. all but the tiled update when tiling is enabled) get no sample
+        for (size_t i = 0; i < stats_before.size(); i++)
+        {
+            const Profiler::Stage stage = update_stages[i].first;
+            if (profiler.get_count(stage) > stats_before[i].first)
+                result.timings_ms[update_stages[i].second].push_back(profiler.get_total_ms(stage) -
+                                                                     stats_before[i].second);
+        }
+
+        start = Clock::now();
+        extractor.get_overlayed_reference_img(overlay);
+        result.timings_ms["overlay"].push_back(get_elapsed_ms(start));
+    }
+    result.buffers_bytes = extractor.get_buffers_num_bytes();
+
+    if (config.check_allocations_)
+        result.steady_state_allocations = count_steady_state_allocations(extractor, config.params_);
+
+    if (config.verify_)
+    {
+        cv::Mat_<uint8_t> mask;
+        cv::threshold(extractor.get_min_diff(), mask, config.params_.ths, 255, cv::THRESH_BINARY_INV);
+        result.morphology_max_mismatch = get_morphology_max_mismatch(mask, result.morphology_exact_mismatches);
+    }
+
+    for (int r = 0; r < config.num_repeats_; r++)
+    {
+        extractor.rewind();
+        extractor.update_mask(config.params_);
+        auto start = Clock::now();
+        auto status = extractor.finalize_mask();
+        result.timings_ms["finalize_mask"].push_back(get_elapsed_ms(start));
+
+        while (status == BackgroundExtractor::Status::Continue)
+        {
+            extractor.update_mask(config.params_);
+            status = extractor.finalize_mask();
+        }
+        start = Clock::now();
+        extractor.get_final_image();
+        result.timings_ms["compose"].push_back(get_elapsed_ms(start));
+    }
+    result.peak_rss_bytes = Profiler::get_peak_rss_bytes();
+    return result;
+}
+
+/// @brief Writes the results as JSON, with the median, the minimum and all the samples of each step
+/// @param checks Results of the checks, or nullptr if they haven't been run
+void write_json(const BenchConfig &config, const CheckResults *checks, const std::vector<DatasetResult> &results,
+                std::ostream &os)
+{
+    os << "{\n";
+    os << "  \"resize_factor\": " << config.resize_factor_ << ",\n";
+    os << "  \"num_threads\": " << config.num_threads_ << ",\n";
+    os << "  \"num_repeats\": " << config.num_repeats_ << ",\n";
+    os << "  \"params\": {\"blur\": " << config.params_.blur_radius << ", \"ths\": " << config.params_.ths
+       << ", \"open\": " << config.params_.open_radius << ", \"erosions\": " << config.params_.num_final_erosions << "},\n";
+    if (checks)
+        os << "  \"checks\": {\"kernel_mismatches\": " << checks->kernel_mismatches
+           << ", \"blur_mismatches\": " << checks->blur_mismatches
+           << ", \"morphology_max_mismatch\": " << checks->morphology_max_mismatch
+           << ", \"morphology_exact_mismatches\": " << checks->morphology_exact_mismatches << "},\n";
+    os << "  \"datasets\": [";
+    for (size_t d = 0; d < results.size(); d++)
+    {
+        const DatasetResult &result = results[d];
+        os << (d > 0 ? "," : "") << "\n    {\n";
+        os << "      \"name\": \"" << result.name << "\",\n";
+        os << "      \"num_images\": " << result.num_images << ",\n";
+        os << "      \"width\": " << result.original_size.width << ",\n";
+        os << "      \"height\": " << result.original_size.height << ",\n";
+        if (result.morphology_max_mismatch >= 0)
+        {
+            os << "      \"morphology_max_mismatch\": " << result.morphology_max_mismatch << ",\n";
+            os << "      \"morphology_exact_mismatches\": " << result.morphology_exact_mismatches << ",\n";
+        }
+        if (result.steady_state_allocations >= 0)
+            os << "      \"steady_state_allocations\": " << result.steady_state_allocations << ",\n";
+        os << "      \"peak_rss_bytes\": " << result.peak_rss_bytes << ",\n";
+        os << "      \"buffers_bytes\": {";
+        for (size_t k = 0; k < result.buffers_bytes.size(); k++)
+            os << (k > 0 ? ", " : "") << "\"" << result.buffers_bytes[k].first << "\": " << result.buffers_bytes[k].second;
+        os << "},\n";
+        os << "      \"timings_ms\": {";
+        bool first = true;
+        for (const auto &timing : result.timings_ms)
+        {
+            std::vector<double> samples = timing.second;
+            std::sort(samples.begin(), samples.end());
+            os << (first ? "" : ",") << "\n        \"" << timing.first << "\": {\"median\": " << samples[samples.size() / 2]
+               << ", \"min\": " << samples.front() << ", \"samples\": [";
+            for (size_t k = 0; k < timing.second.size(); k++)
+                os << (k > 0 ? ", " : "") << timing.second[k];
+            os << "]}";
+            first = false;
+        }
+        os << "\n      }\n    }";
+    }
+    os << "\n  ]\n}\n";
+}
+
+/// @brief Utility function to parse command line attributes
+bool parse_command_line(int argc, char *argv[], BenchConfig &config)
+{
+    const std::string program_desc(
+        "Time the loading, the three stages of the mask update, the overlay, the finalization\n"
+        "and the composition of the final image, on image directories and on synthetic bursts.\n"
+        "Results are written as JSON.\n");
+
+    boost_po::options_description options_desc;
+    boost_po::options_description base_options("Base options");
+    // clang-format off
+    base_options.add_options()
+        ("help,h", "Produce help message.")
+        ("images_dir,i", boost_po::value<std::vector<std::string>>(&config.images_dir_paths_)->multitoken(),
+                                                              "Path to the directories containing the images (e.g. images/Test1).")
+        ("images-extension,e", boost_po::value<std::string>(&config.images_extension_)->default_value("JPG"), "Extension of the images.")
+        ("synthetic", boost_po::value<std::vector<std::string>>(&config.synthetic_sizes_)->multitoken(),
+                                                              "Sizes of synthetic bursts to generate: '4k', '8k' or '<width>x<height>'.")
+        ("num-images,n", boost_po::value<int>(&config.synthetic_params_.num_images)->default_value(8), "Number of images of the synthetic bursts.")
+        ("density", boost_po::value<float>(&config.synthetic_params_.object_density)->default_value(0.1f),
+                                                              "Fraction of the synthetic images covered by moving objects.")
+        ("seed", boost_po::value<int>(&config.synthetic_params_.seed)->default_value(0), "Seed of the synthetic bursts.")
+        ("resize,r", boost_po::value<float>(&config.resize_factor_)->default_value(0.25f), "Resize factor used internally to work on smaller images.")
+        ("threads,t", boost_po::value<int>(&config.num_threads_)->default_value(0), "Number of threads (0 to use all the cores).")
+        ("blur-cache", boost_po::value<int>(&config.blur_cache_mb_)->default_value(0),
+                                                              "Memory budget (MB) of the blurred images cache. Disabled by default to time the blur.")
+        ("repeats", boost_po::value<int>(&config.num_repeats_)->default_value(5), "Number of samples of each step.")
+        ("verify", boost_po::bool_switch(&config.verify_),
+                                                              "Check the fused diff kernel and the distance map morphology against OpenCV.")
+        ("check-allocations", boost_po::bool_switch(&config.check_allocations_),
+                                                              "Check that changing the parameters doesn't allocate memory once they've all been processed once. "
+                                                              "Buffers allocated inside OpenCV functions with cv::fastMalloc aren't counted.")
+        ("blur", boost_po::value<int>(&config.params_.blur_radius)->default_value(config.params_.blur_radius), "Blurring kernel radius.")
+        ("ths", boost_po::value<int>(&config.params_.ths)->default_value(config.params_.ths), "Grayscale threshold in [0,255].")
+        ("open", boost_po::value<int>(&config.params_.open_radius)->default_value(config.params_.open_radius), "Kernel radius of the morphological opening.")
+        ("erosions", boost_po::value<int>(&config.params_.num_final_erosions)->default_value(config.params_.num_final_erosions),
+                                                              "Number of 5x5 erosions applied at the end.")
+        ("output,o", boost_po::value<std::string>(&config.output_path_), "Path of the JSON file. Written to the standard output if empty.")
+        ;
+    // clang-format on
+    options_desc.add(base_options);
+
+    boost_po::variables_map vm;
+    try
+    {
+        boost_po::store(boost_po::command_line_parser(argc, argv).options(options_desc).run(), vm);
+        boost_po::notify(vm);
+    }
+    catch (boost_po::error &e)
+    {
+        std::cerr << program_desc << std::endl;
+        std::cerr << options_desc << std::endl;
+        std::cerr << "Parsing error:" << e.what() << std::endl;
+        return false;
+    }
+
+    if (vm.count("help"))
+    {
+        std::cout << program_desc << std::endl;
+        std::cout << options_desc << std::endl;
+        return false;
+    }
+    if (config.images_dir_paths_.empty() && config.synthetic_sizes_.empty() && !config.verify_)
+    {
+        std::cerr << "At least one input image directory or synthetic size is required, unless only checks are run." << std::endl;
+        return false;
+    }
+    if (config.num_repeats_ < 1)
+    {
+        std::cerr << "At least one sample is required." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    BenchConfig config;
+    if (!parse_command_line(argc, argv, config))
+        return 1;
+
+    bool valid = true;
+    CheckResults checks;
+    if (config.verify_)
+    {
+        checks = run_checks(config.synthetic_params_.seed);
+        if (checks.kernel_mismatches > 0)
+        {
+            std::cerr << checks.kernel_mismatches << " pixels differ between the fused diff kernel and OpenCV" << std::endl;
+            valid = false;
+        }
+        if (checks.blur_mismatches > 0)
+        {
+            std::cerr << checks.blur_mismatches << " values differ between the summed-area table blur and cv::blur" << std::endl;
+            valid = false;
+        }
+        if (checks.morphology_exact_mismatches > 0 || checks.morphology_max_mismatch > morphology_max_mismatch_tolerance)
+        {
+            std::cerr << "The distance map morphology differs from cv::erode and cv::dilate beyond the tolerance" << std::endl;
+            valid = false;
+        }
+    }
+
+    std::vector<DatasetResult> results;
+    for (const auto &images_dir_path : config.images_dir_paths_)
+    {
+        std::cerr << "Benchmarking " << images_dir_path << " ..." << std::endl;
+        results.push_back(run_dataset(images_dir_path, images_dir_path, config.images_extension_, config));
+    }
+
+    for (const auto &synthetic_size : config.synthetic_sizes_)
+    {
+        SyntheticBurstParams synthetic_params = config.synthetic_params_;
+        if (!parse_size(synthetic_size, synthetic_params.size))
+        {
+            std::cerr << "Invalid synthetic size: " << synthetic_size << std::endl;
+            return 1;
+        }
+
+        const bfs::path dir_path = bfs::temp_directory_path() / bfs::unique_path("background_extraction_%%%%%%%%");
+        std::cerr << "Generating a " << synthetic_size << " synthetic burst in " << dir_path.string() << " ..." << std::endl;
+        if (!generate_synthetic_burst(synthetic_params, dir_path.string()))
+            return 1;
+        std::cerr << "Benchmarking " << synthetic_size << " ..." << std::endl;
+        results.push_back(run_dataset("synthetic_" + synthetic_size, dir_path.string(), synthetic_params.extension, config));
+        bfs::remove_all(dir_path);
+    }
+
+    if (config.output_path_.empty())
+        write_json(config, config.verify_ ? &checks : nullptr, results, std::cout);
+    else
+    {
+        std::ofstream file(config.output_path_.c_str());
+        write_json(config, config.verify_ ? &checks : nullptr, results, file);
+        std::cerr << "Results have been written to " << config.output_path_ << std::endl;
+    }
+
+    for (const auto &result : results)
+    {
+        valid &= result.num_images > 0 && result.steady_state_allocations <= 0;
+        if (result.morphology_exact_mismatches > 0 || result.morphology_max_mismatch > morphology_max_mismatch_tolerance)
+        {
+            std::cerr << result.name << ": the distance map morphology differs from cv::erode and cv::dilate beyond the tolerance" << std::endl;
+            valid = false;
+        }
+        if (result.steady_state_allocations > 0)
+            std::cerr << result.name << ": " << result.steady_state_allocations
+                      << " heap allocations while changing the parameters after the warm-up" << std::endl;
+    }
+    return valid ? 0 : 1;
+}
@@ -0,0 +1,73 @@
+/*********************************************************************************************************************
+ * File : synthetic_burst.cpp                                                                                        *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include <boost/filesystem.hpp>
+#include <cstdio>
+#include <iostream>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "synthetic_burst.h"
+
+namespace bfs = boost::filesystem;
+
+bool generate_synthetic_burst(const SyntheticBurstParams &params, const std::string &dir_path)
+{
+    bfs::create_directories(dir_path);
+    cv::RNG rng(params.seed);
+
+    // Smooth colors with some fine texture, so that blurring and thresholding behave as on real pictures
+    cv::Mat coarse_background(std::max(2, params.size.height / 64), std::max(2, params.size.width / 64), CV_8UC3);
+    rng.fill(coarse_background, cv::RNG::UNIFORM, cv::Scalar::all(0), cv::Scalar::all(256));
+    cv::Mat background;
+    cv::resize(coarse_background, background, params.size, 0, 0, cv::INTER_CUBIC);
+    cv::Mat texture(params.size, CV_16SC3);
+    rng.fill(texture, cv::RNG::NORMAL, cv::Scalar::all(0), cv::Scalar::all(8));
+    cv::add(background, texture, background, cv::noArray(), CV_8UC3);
+
+    const int min_object_radius = std::max(1, std::min(params.size.width, params.size.height) / 40);
+    const int max_object_radius = std::max(2, std::min(params.size.width, params.size.height) / 10);
+    const int target_num_object_pixels = int(params.object_density * params.size.area());
+    cv::Mat img, noise(params.size, CV_16SC3);
+    cv::Mat_<uint8_t> objects_mask(params.size);
+    for (int i = 0; i < params.num_images; i++)
+    {
+        rng.fill(noise, cv::RNG::NORMAL, cv::Scalar::all(0), cv::Scalar::all(2));
+        cv::add(background, noise, img, cv::noArray(), CV_8UC3);
+
+        // Draw objects of random colors at random places, until they cover the expected fraction of the image
+        objects_mask.setTo(0);
+        int num_object_pixels = 0;
+        while (num_object_pixels < target_num_object_pixels)
+        {
+            const cv::Point center(rng.uniform(0, params.size.width), rng.uniform(0, params.size.height));
+            const int radius = rng.uniform(min_object_radius, max_object_radius);
+            const cv::Scalar color(rng.uniform(0, 256), rng.uniform(0, 256), rng.uniform(0, 256));
+            if (rng.uniform(0, 2) == 0)
+            {
+                cv::circle(img, center, radius, color, cv::FILLED);
+                cv::circle(objects_mask, center, radius, cv::Scalar(255), cv::FILLED);
+            }
+            else
+            {
+                const cv::Rect rect(center.x - radius, center.y - radius / 2, 2 * radius, radius);
+                cv::rectangle(img, rect, color, cv::FILLED);
+                cv::rectangle(objects_mask, rect, cv::Scalar(255), cv::FILLED);
+            }
+            num_object_pixels = cv::countNonZero(objects_mask);
+        }
+
+        char filename[32];
+        snprintf(filename, sizeof(filename), "img_%04d.%s", i, params.extension.c_str());
+        const std::string img_path = (bfs::path(dir_path) / filename).string();
+        if (!cv::imwrite(img_path, img))
+        {
+            std::cerr << "Unable to write the synthetic image " << img_path << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,30 @@
+/*********************************************************************************************************************
+ * File : synthetic_burst.h                                                                                          *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#ifndef SYNTHETIC_BURST_H
+#define SYNTHETIC_BURST_H
+
+#include <opencv2/core/mat.hpp>
+#include <string>
+
+/// @brief Parameters of a synthetic burst of images taken from a fixed camera
+struct SyntheticBurstParams
+{
+    cv::Size size = cv::Size(3840, 2160); ///< Size of the images
+    int num_images = 8;
+    float object_density = 0.1f;   ///< Fraction of each image covered by moving objects
+    int seed = 0;                  ///< Seed of the random generator, to reproduce the same burst
+    std::string extension = "jpg"; ///< Extension, i.e. format, of the image files
+};
+
+/// @brief Writes a burst of images made of the same textured background, with sensor noise and randomly placed
+/// moving objects
+/// @param params Parameters of the burst
+/// @param dir_path Directory where the images are written. It's created if needed
+/// @return true if all the images have been written
+bool generate_synthetic_burst(const SyntheticBurstParams &params, const std::string &dir_path);
+
+#endif // SYNTHETIC_BURST_H
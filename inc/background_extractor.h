@@ -7,7 +7,22 @@
 #ifndef BACKGROUND_EXTRACTOR_H
 #define BACKGROUND_EXTRACTOR_H
 
+#include <atomic>
+#include <future>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <opencv2/core/mat.hpp>
+#include <string>
+#include <utility>
+
+#include "blurred_image_cache.h"
+#include "integral_image.h"
+#include "mask_morphology.h"
+#include "pixel_histogram.h"
+#include "profiler.h"
+#include "thread_pool.h"
+#include "working_image_cache.h"
 
 class BackgroundExtractor
 {
@@ -19,6 +34,12 @@ public:
         Fail      ///< There's no images left and there remains uncovered parts in the final image
     };
 
+    enum ReferenceOrder
+    {
+        FileOrder, ///< Reference images are taken in the order of their filenames
+        Coverage   ///< The next reference image is the one expected to recover the most missing pixels
+    };
+
     struct ProcessingParams
     {
         ProcessingParams(int blur_radius, int ths, int open_radius, int num_final_erosions);
@@ -43,7 +64,14 @@ public:
     /// @note The color should have a high contrast with respect to the input image to help it stand out
     BackgroundExtractor(float resize_factor = 1.f, cv::Vec3b bg_color = cv::Vec3b(0, 0, 255));
 
-    ~BackgroundExtractor() = default;
+    /// @brief Constructor using a given thread pool, e.g. shared with other extractors, instead of creating one
+    /// @param resize_factor Work with downsampled images to determine selection masks
+    /// @param thread_pool Thread pool used to load images and to update the mask
+    /// @param bg_color Background color used to show pixels that haven't been recovered yet in the final image
+    BackgroundExtractor(float resize_factor, const std::shared_ptr<ThreadPool> &thread_pool,
+                        cv::Vec3b bg_color = cv::Vec3b(0, 0, 255));
+
+    ~BackgroundExtractor();
 
     /// @brief Loads images from a directory and resizes them for the next processing steps
     /// @param dir_path Path to the directory containing the images to load
@@ -53,18 +81,35 @@ public:
 
     /// @brief Estimates the background mask in the reference image
     ///
-    /// 1) Blur the difference images (reference image against all the other images)
-    /// 2) Apply a threshold on the grayscale intensity of the blurred differences
+    /// 1) Blur the difference images (reference image against all the other images) and keep their
+    /// per-pixel minimum
+    /// 2) Apply a threshold on the grayscale intensity of this minimum blurred difference
     /// 3) Perform a morphological opening to remove small noisy areas
     ///
-    /// Once we get a binary mask for each image (0: different / 255: identical),
-    /// we concatenate them all using a logical OR.
+    /// Thresholding the minimum difference gives the same binary mask (0: different / 255: identical)
+    /// as thresholding each difference and concatenating them all using a logical OR.
     ///
     /// @note If the parameters haven't changed since the last call to this function, the processing is
     /// skipped and the method returns the previous version of the mask
     /// @param params Processing parameters
     void update_mask(const ProcessingParams &params);
 
+    /// @brief Asynchronous version of update_mask, meant to keep the GUI responsive
+    ///
+    /// The mask is computed in the thread pool. Requests are coalesced: only the latest parameters are computed, and
+    /// the work in progress is cancelled when new parameters arrive, resuming from the last completed stage. Once the
+    /// mask is ready, the differences of the image expected to be the next reference are computed speculatively,
+    /// so that the next reference image doesn't need to wait for them.
+    /// @param params Processing parameters
+    /// @note The mask mustn't be read until poll_mask_update returns true
+    void request_mask_update(const ProcessingParams &params);
+
+    /// @brief Checks whether the mask of the latest parameters passed to request_mask_update is ready
+    bool poll_mask_update();
+
+    /// @brief Waits for the asynchronous update, including the speculative work
+    void wait_mask_update();
+
     /// @brief Gets the current reference image overlayed with selection_masks
     /// @param img Output image
     void get_overlayed_reference_img(cv::Mat &img);
@@ -73,31 +118,303 @@ public:
     /// @return Process status
     Status finalize_mask();
 
+    /// @brief Automatically builds the final image, without any reference image
+    ///
+    /// Each pixel is taken from the image whose blurred neighbourhood agrees with the most other images: the
+    /// grayscale intensities of the blurred images are counted in a per-pixel histogram, whose memory doesn't depend
+    /// on the number of images, and the image falling into the most voted bin is selected. Pixels whose intensity
+    /// isn't shared by at least two images are left uncovered.
+    /// @param blur_radius Blurring kernel size
+    /// @param num_bins Number of grayscale bins. The fewer the bins, the more tolerant the vote is
+    /// @return Success if all the pixels have been recovered, Fail otherwise
+    /// @note It replaces the update_mask/finalize_mask loop: afterwards, update_mask does nothing, finalize_mask
+    /// returns Fail and get_overlayed_reference_img returns the voted preview, until the next load_images
+    Status vote_final_image(int blur_radius, int num_bins = 32);
+
+    /// @brief Restarts from an empty final image, keeping the loaded images
+    void rewind();
+
     /// @brief Gets the final image of the background
+    ///
+    /// While reference images are still being processed, only a preview is returned, composed from the working
+    /// images. Once the process is over, the full-resolution image is composed in a single pass from the label map,
+    /// i.e. the ID of the image owning each pixel of the working images
     const cv::Mat &get_final_image();
 
+    /// @brief Sets the radius (in pixels of the label map) within which images are blended at the boundaries of
+    /// the label map, to hide the seams of the final image
+    /// @param feather_radius Feathering radius, or 0 to disable it
+    /// @note It isn't available in streaming mode
+    void set_feathering(int feather_radius);
+
+    /// @brief Selects the order in which reference images are processed
+    ///
+    /// With the Coverage order, each pixel of an image is expected to be selected if its blurred grayscale intensity
+    /// is shared by another image, which is cheaply estimated once from a per-pixel histogram. The next reference is
+    /// then the image expected to recover the most pixels that are still missing, like a greedy set cover, which
+    /// reduces the number of reference images needed to fill the final image.
+    /// @param order Order of the reference images
+    /// @param blur_radius Blurring kernel size used to estimate the coverage
+    /// @note It must be called before load_images
+    void set_reference_order(ReferenceOrder order, int blur_radius = 5);
+
+    /// @brief Enables the coarse-to-fine mode, where masks are tuned on the working images and refined at a higher
+    /// resolution when they're finalized
+    ///
+    /// Upsampling the mask smears the decision along its edges. In this mode, the label map has the refined
+    /// resolution, and differences are only computed again at this resolution in a narrow band around the edges of
+    /// the mask. Only the tiles crossed by this band are blurred. The refinement only removes pixels from the mask.
+    /// @param refine_factor Resize factor of the refined level, larger than the working one. Use 0 to disable it
+    /// @note It must be called before load_images
+    void set_refinement(float refine_factor);
+
+    /// @brief Enables the on-disk cache of the working images, so that reloading a dataset doesn't decode it again
+    /// @param dir_path Directory of the cache files, or an empty string to disable the cache
+    /// @param max_bytes Maximum total size of the cache files
+    /// @note Full-resolution images of a dataset loaded from the cache are only decoded when they're needed
+    void set_disk_cache(const std::string &dir_path, size_t max_bytes);
+
+    /// @brief Checks whether the working images of the last loaded dataset came from the disk cache
+    bool is_loaded_from_disk_cache() const;
+
+    /// @brief Enables the streaming mode, where only the downsampled images stay in memory
+    ///
+    /// The full-resolution images used by the final image are decoded again when it's composed, one at a time, and
+    /// the next one is decoded in the background meanwhile. With a resize factor of 1/2, 1/4 or 1/8, JPEG images are
+    /// directly decoded at the reduced resolution.
+    /// @note It must be called before load_images
+    void set_streaming(bool streaming);
+
+    /// @brief Enables the tiled mode, meant for very large working images (e.g. gigapixel images processed with a
+    /// resize factor of 1)
+    ///
+    /// update_mask blurs the images and computes the minimum difference tile by tile, in parallel. Blurred images
+    /// are then bounded by the tile size instead of the image size, but the minimum difference is kept for the whole
+    /// image, so that moving the threshold, opening or erosion sliders doesn't blur the images again. These
+    /// operations run on tiles extended by a halo covering the reach of the morphological operations, so that
+    /// there's no seam. get_best_match_ids isn't available.
+    /// @param tile_size Size of the square tiles, or 0 to disable the tiled mode
+    /// @note It must be called before load_images
+    void set_tile_size(int tile_size);
+
+    /// @brief Sets the number of threads used to load images and to update the mask
+    /// @param num_threads Number of threads. Use all the available cores if lower than 1
+    void set_num_threads(int num_threads);
+
+    /// @brief Uses a thread pool shared with other extractors, instead of a pool of its own
+    /// @note Parallel loops of several extractors can run in the same pool at the same time
+    void set_thread_pool(const std::shared_ptr<ThreadPool> &thread_pool);
+
+    /// @brief Selects how the opening and the final erosions are computed
+    /// @note Distance maps (default) make their cost independent of the kernel sizes
+    void set_morphology_engine(MaskMorphology::Engine engine);
+
+    /// @brief Sets the memory budget of the blurred images kept in memory across reference images
+    /// @note The least recently used blurred images are discarded once the budget is exceeded
+    void set_blur_cache_size(size_t max_bytes);
+
+    /// @brief Sets up the summed-area tables computed in load_images, from which blurred images are derived in
+    /// O(1) per pixel whatever the radius
+    /// @param max_blur_radius Largest blur radius derived from the tables. Larger radii use cv::blur
+    /// @param max_bytes Memory budget of the tables of all the images. They're not computed if it's exceeded
+    /// @note It must be called before load_images
+    void set_integral_images(int max_blur_radius, size_t max_bytes);
+
+    /// @brief Gets the memory used by the summed-area tables
+    size_t get_integral_images_num_bytes() const;
+
+    /// @brief Gets the per-pixel minimum of the grayscale blurred differences against the reference image
+    const cv::Mat_<uint8_t> &get_min_diff() const;
+
+    /// @brief Gets, for each pixel, the ID of the image whose blurred difference against the reference image
+    /// is the smallest, i.e. the image that matched this pixel
+    /// @note It doesn't depend on the threshold: compare get_min_diff against it to know whether the pixel actually
+    /// matched. Only pixels where all the differences are 255 keep the reference ID
+    const cv::Mat_<uint16_t> &get_best_match_ids() const;
+
+    /// @brief Gets the number of images loaded from the directory
+    int get_num_images() const;
+
+    /// @brief Estimates the memory needed to process a dataset in batch mode with the current settings, i.e. with a
+    /// single blur radius
+    /// @param original_size Size of the images
+    /// @param num_images Number of images
+    size_t estimate_num_bytes(cv::Size original_size, int num_images) const;
+
+    /// @brief Gets the size of the original images, i.e. of the final image
+    cv::Size get_original_size() const;
+
+    /// @brief Enables the measurement of the wall time of each processing stage
+    /// @note When it's disabled, the stages aren't timed at all. Enabling it clears the previous measurements
+    void set_profiling(bool profiling);
+
+    /// @brief Gets the wall times of the processing stages, and the number of stages skipped because their parameters
+    /// haven't changed
+    const Profiler &get_profiler() const;
+
+    /// @brief Gets the memory resident in each buffer, in bytes
+    /// @note Buffers sharing their data with another one aren't counted twice
+    std::vector<std::pair<std::string, size_t>> get_buffers_num_bytes() const;
+
+    /// @brief Writes the stage timings, the memory of the buffers and the peak resident memory of the process as JSON
+    void write_profile(std::ostream &os) const;
+
 private:
     /// @brief Clears vectors of images and resets reference ID to 0
     void reset();
 
-    int img_to_diff_id(int img_id);
+    /// @brief Decodes and resizes the images of filenames_
+    /// @return true if they've all been correctly decoded and have the same size
+    bool decode_images();
+
+    /// @brief Gets a blurred resized image, from the cache if it has already been computed
+    void get_blurred_img(int img_id, int blur_radius, cv::Mat &blurred_img);
+
+    /// @brief Computes the mask, unless it's cancelled
+    /// @param generation Generation of the asynchronous request, or -1 for a synchronous update
+    /// @return false if it has been cancelled by a newer request
+    bool compute_mask(const ProcessingParams &params, int generation);
+
+    /// @brief Computes the per-pixel minimum of the blurred differences against a reference image
+    /// @return false if it has been cancelled by a newer request
+    bool compute_min_diff(int ref_id, cv::Mat_<uint8_t> &min_diff, cv::Mat_<uint16_t> &best_match_ids, int generation);
+
+    /// @brief Processes asynchronous requests until there's no new one
+    void run_async_updates();
+
+    /// @brief Computes the differences of the image expected to be the next reference
+    void compute_speculative_min_diff(int blur_radius, int generation);
+
+    /// @brief Checks whether a newer asynchronous request has been made
+    bool is_cancelled(int generation) const;
+
+    /// @brief Computes the minimum difference tile by tile in the tiled mode
+    void compute_min_diff_tiled(int blur_radius);
+
+    /// @brief Thresholds the minimum difference and applies the morphological operations tile by tile in the tiled
+    /// mode
+    void update_mask_tiled(const ProcessingParams &params);
+
+    /// @brief Gets a tile of the working images, clipped to their borders
+    cv::Rect get_tile(int tile_id, int num_tiles_x) const;
+
+    /// @brief Counts the grayscale bins of the blurred images in a per-pixel histogram
+    /// @param imgs_bins If not null, also stores the bins of each image
+    void count_blurred_bins(int blur_radius, PixelHistogram &histogram, std::vector<cv::Mat_<uint8_t>> *imgs_bins = nullptr);
+
+    /// @brief Selects the next reference image among the ones that haven't been used yet
+    /// @return false if they've all been used
+    bool select_next_reference();
+
+    /// @brief Finds the next reference image among the ones that haven't been used yet
+    /// @param excluded_id ID of an image to skip, or -1
+    /// @return ID of the image, or -1 if there's none left
+    int find_next_reference(int excluded_id);
+
+    /// @brief Records the owner of the new pixels in the label map, after refining the mask around its edges
+    void update_refined_labels();
 
-    std::vector<cv::Mat> original_imgs_;
+    /// @brief Composes the full-resolution final image from the label map
+    void compose_final_image();
+
+    /// @brief Gets a full-resolution image, decoding it again in streaming mode
+    cv::Mat get_original_img(int img_id);
+
+    /// @brief Decodes a full-resolution image in the background, in streaming mode
+    void prefetch_original_img(int img_id);
+
+    /// @brief Waits for the full-resolution image being decoded in the background
+    void wait_prefetch();
+
+    /// @brief Gets the number of bands of rows used to split the working images between workers
+    int get_num_bands() const;
+
+    /// @brief Gets the rows of a band of the working images
+    cv::Range get_band_rows(int band_id, int num_bands) const;
+
+    std::vector<cv::String> filenames_;
+    WorkingImageCache working_imgs_cache_;
+    bool loaded_from_disk_cache_;
+    std::vector<cv::Mat> original_imgs_; ///< Full-resolution images, empty in streaming mode
     std::vector<cv::Mat> resized_imgs_;
 
-    cv::Mat tmp_blurred_ref_, tmp_cv8uc3_;
-    std::vector<cv::Mat_<uint8_t>> uchar_blurred_diffs_;
+    bool streaming_;
+    cv::Mat prefetched_img_; ///< Full-resolution image decoded in advance in streaming mode
+    int prefetched_id_;      ///< ID of the prefetched image, or -1
+    std::future<void> prefetch_done_;
+
+    /// @brief Scratch buffers of a worker in the tiled mode
+    struct TileBuffers
+    {
+        cv::Mat blurred_ref, blurred_img;
+        cv::Mat_<uint8_t> min_diff;
+        cv::Mat_<uint16_t> best_match_ids;
+        cv::Mat_<uint8_t> mask;
+        MaskMorphology morphology;
+    };
+
+    std::shared_ptr<ThreadPool> thread_pool_;
+    int tile_size_;
+    std::vector<TileBuffers> tile_buffers_;
+    BlurredImageCache blurred_imgs_cache_;
+
+    std::vector<IntegralImage> integral_imgs_; ///< Summed-area tables of the resized images
+    int max_blur_radius_;
+    size_t integral_imgs_max_bytes_;
+
+    std::vector<cv::Mat> blurred_imgs_; ///< Blurred resized images, shared with the cache
+
+    cv::Mat_<uint8_t> min_diff_;        ///< Minimum grayscale blurred difference against the reference image
+    cv::Mat_<uint16_t> best_match_ids_; ///< ID of the image reaching this minimum
+
+    std::mutex async_mutex_;
+    ProcessingParams async_params_;     ///< Latest parameters requested asynchronously
+    std::atomic<int> async_generation_; ///< Incremented by each request, to cancel older ones
+    bool async_running_;
+    bool async_mask_ready_;
+    std::future<void> async_done_;
+
+    cv::Mat_<uint8_t> speculative_min_diff_; ///< min_diff_ of the expected next reference image
+    cv::Mat_<uint16_t> speculative_best_match_ids_;
+    int speculative_ref_id_; ///< ID of the expected next reference image, or -1
+    int speculative_blur_radius_;
 
     cv::Mat_<uint8_t> tmp_mask_;
     cv::Mat_<uint8_t> mask_before_morph_;
 
+    MaskMorphology morphology_;
     cv::Mat_<uint8_t> mask_; ///< Mask
     cv::Mat_<uint8_t> original_size_mask_;
 
+    float refine_factor_;
+    cv::Mat_<uint8_t> coarse_edges_;  ///< Edges of the mask at the working resolution
+    cv::Mat_<uint8_t> refined_edges_; ///< Edges of the mask at the label resolution
+    cv::Mat_<uint8_t> refined_mask_;
+    std::vector<cv::Rect> refined_tiles_; ///< Tiles of the label map crossed by the edges of the mask
+    cv::Mat refined_img_;                 ///< Original image resized to the label resolution, if needed
+    cv::Mat refined_blurred_ref_;         ///< Blurred reference image, only valid in the refined tiles
+    cv::Mat_<uint8_t> refined_min_diff_;  ///< Minimum difference against the reference, only valid in the refined tiles
+
+    static constexpr uint16_t no_label = std::numeric_limits<uint16_t>::max();
+    cv::Mat_<uint16_t> label_map_; ///< ID of the image owning each pixel, or no_label
+    cv::Size label_size_;          ///< Size of the label map, larger than the working size when refining masks
+    cv::Mat_<uint8_t> label_no_info_mask_; ///< no_info_mask_ at the label resolution, sharing its data if they match
+    cv::Mat preview_img_;          ///< Final image composed from the working images
     cv::Mat final_img_;
+    bool session_done_;       ///< No reference image is left to process
+    bool voted_;              ///< The labels come from vote_final_image, so there's no reference image to tune
+    bool final_img_composed_; ///< The final image is up to date with the label map
+    int feather_radius_;
     cv::Mat_<uint8_t> no_info_mask_; ///< Parts of the final image that haven't been updated yet
 
     int crt_id_ref_;
+    std::vector<bool> used_refs_; ///< Images that have already been used as reference
+
+    static constexpr int order_num_bins = 32;
+    ReferenceOrder reference_order_;
+    int order_blur_radius_;
+    PixelHistogram order_histogram_;            ///< Votes of all the images, used to sort the reference images
+    std::vector<cv::Mat_<uint8_t>> order_bins_; ///< Bins of each image in this histogram
     bool valid_mask_;
 
     int last_blur_radius_;
@@ -111,6 +428,8 @@ private:
     cv::Vec3b bg_color_;
 
     ProcessingParams last_params_;
+
+    Profiler profiler_;
 };
 
 #endif // BACKGROUND_EXTRACTOR_H
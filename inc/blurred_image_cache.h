@@ -0,0 +1,70 @@
+/*********************************************************************************************************************
+ * File : blurred_image_cache.h                                                                                      *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#ifndef BLURRED_IMAGE_CACHE_H
+#define BLURRED_IMAGE_CACHE_H
+
+#include <list>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <opencv2/core/mat.hpp>
+
+/// @brief Keeps blurred images in memory, so that they don't need to be blurred again when the reference image
+/// changes or when going back to a blur radius that has already been used
+/// @note The least recently used images are evicted once the memory budget is exceeded
+/// @note All the methods are thread-safe
+class BlurredImageCache
+{
+public:
+    /// @brief Constructor
+    /// @param max_bytes Memory budget of the cached images
+    explicit BlurredImageCache(size_t max_bytes = size_t(1) << 30);
+
+    ~BlurredImageCache() = default;
+
+    /// @brief Sets the memory budget and evicts images if needed
+    void set_max_bytes(size_t max_bytes);
+
+    /// @brief Looks for a blurred image in the cache
+    /// @param img_id Index of the image
+    /// @param blur_radius Radius of the blurring kernel
+    /// @param blurred_img Output blurred image, sharing its data with the cached one
+    /// @return true if the image was in the cache
+    bool find(int img_id, int blur_radius, cv::Mat &blurred_img);
+
+    /// @brief Adds a blurred image to the cache
+    /// @note Its data is shared, so it mustn't be modified afterwards
+    void insert(int img_id, int blur_radius, const cv::Mat &blurred_img);
+
+    /// @brief Removes all the images from the cache
+    void clear();
+
+    /// @brief Gets the memory used by the cached images
+    size_t get_num_bytes() const;
+
+private:
+    using Key = std::pair<int, int>; ///< Image ID and blur radius
+
+    struct Entry
+    {
+        cv::Mat blurred_img;
+        std::list<Key>::iterator lru_it;
+    };
+
+    /// @brief Removes the least recently used images until the memory budget is met. mutex_ must be locked
+    void evict();
+
+    mutable std::mutex mutex_;
+
+    std::map<Key, Entry> entries_;
+    std::list<Key> lru_keys_; ///< Most recently used first
+
+    size_t num_bytes_;
+    size_t max_bytes_;
+};
+
+#endif // BLURRED_IMAGE_CACHE_H
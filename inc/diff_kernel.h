@@ -0,0 +1,35 @@
+/*********************************************************************************************************************
+ * File : diff_kernel.h                                                                                              *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#ifndef DIFF_KERNEL_H
+#define DIFF_KERNEL_H
+
+#include <cstddef>
+#include <cstdint>
+
+/// @brief Memory budget of the rows processed at once when comparing the reference image against all the other
+/// images, so that the minimum difference stays in the L2 cache from one image to the next
+const size_t diff_tile_max_bytes = 128 * 1024;
+
+/// @brief Number of bytes read or written per pixel of a row by update_min_gray_absdiff
+const size_t diff_kernel_bytes_per_pixel = 3 + 3 + sizeof(uint8_t) + sizeof(uint16_t);
+
+/// @brief Computes the grayscale intensity of the absolute difference between two BGR rows and keeps its
+/// per-pixel minimum, in a single pass
+///
+/// It gives the same result as cv::absdiff, then cv::cvtColor(cv::COLOR_BGR2GRAY), then a per-pixel minimum,
+/// without storing the intermediate images. It uses OpenCV universal intrinsics when available.
+///
+/// @param ref_row BGR row of the reference image
+/// @param img_row BGR row of the image to compare
+/// @param width Number of pixels in the rows
+/// @param img_id ID of the compared image
+/// @param min_diff_row Row of minimum grayscale differences to update
+/// @param best_match_row Row of IDs of the images reaching the minimum, set to img_id where the minimum decreases
+void update_min_gray_absdiff(const uint8_t *ref_row, const uint8_t *img_row, int width, uint16_t img_id,
+                             uint8_t *min_diff_row, uint16_t *best_match_row);
+
+#endif // DIFF_KERNEL_H
@@ -0,0 +1,56 @@
+/*********************************************************************************************************************
+ * File : integral_image.h                                                                                           *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#ifndef INTEGRAL_IMAGE_H
+#define INTEGRAL_IMAGE_H
+
+#include <opencv2/core/mat.hpp>
+
+/// @brief Summed-area table of a BGR image, from which a box blur of any radius is derived in O(1) per pixel
+///
+/// The image is padded by reflection before being summed, like the default border of cv::blur. Each sum is divided
+/// by the box area and rounded to the nearest integer, which benchmark --verify checks against the fixed-point
+/// division of cv::blur for all the radii up to the largest one.
+/// Sums are stored on 32 bits and are allowed to wrap around: the sum over a box is still exact, since it's lower
+/// than 2^32 for any radius below 2000.
+class IntegralImage
+{
+public:
+    IntegralImage();
+
+    ~IntegralImage() = default;
+
+    /// @brief Gets the number of bytes needed by the summed-area table of an image
+    /// @param size Size of the image
+    /// @param max_radius Largest blur radius that will be used
+    static size_t get_num_bytes(cv::Size size, int max_radius);
+
+    /// @brief Computes the summed-area table
+    /// @param img BGR image
+    /// @param max_radius Largest blur radius that will be used
+    void compute(const cv::Mat &img, int max_radius);
+
+    /// @brief Releases the summed-area table
+    void release();
+
+    /// @brief Box blur with a (2 * blur_radius + 1) x (2 * blur_radius + 1) kernel
+    /// @param blur_radius Blur radius, lower or equal to the one used to compute the table
+    /// @param blurred_img Output blurred image
+    void box_blur(int blur_radius, cv::Mat &blurred_img) const;
+
+    /// @brief Checks if the table can be used to blur with a given radius
+    bool can_blur(int blur_radius) const;
+
+    /// @brief Gets the number of bytes used by the summed-area table
+    size_t get_num_bytes() const;
+
+private:
+    cv::Mat sums_; ///< CV_32SC3 summed-area table of the padded image, read as unsigned integers
+    cv::Size size_;
+    int max_radius_;
+};
+
+#endif // INTEGRAL_IMAGE_H
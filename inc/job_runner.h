@@ -0,0 +1,107 @@
+/*********************************************************************************************************************
+ * File : job_runner.h                                                                                               *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#ifndef JOB_RUNNER_H
+#define JOB_RUNNER_H
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "background_extractor.h"
+#include "thread_pool.h"
+
+/// @brief Processes a queue of datasets in batch mode, several of them at the same time
+///
+/// All the extractors share the same thread pool, so that the decoding, the masks and the composition of different
+/// datasets overlap and keep all the cores busy. A dataset only starts once its estimated memory fits in the global
+/// budget, next to the datasets already running.
+class JobRunner
+{
+public:
+    struct Job
+    {
+        Job(const std::string &images_dir_path, const std::string &images_extension,
+            const BackgroundExtractor::ProcessingParams &params);
+
+        std::string images_dir_path;
+        std::string images_extension;
+        BackgroundExtractor::ProcessingParams params; ///< Parameters used for all the reference images
+        bool vote;                                    ///< Use vote_final_image instead of reference images
+    };
+
+    struct Result
+    {
+        bool loaded = false; ///< False if the images couldn't be loaded
+        BackgroundExtractor::Status status = BackgroundExtractor::Status::Fail;
+        int num_images = 0;
+        int num_passes = 0;  ///< Number of reference images
+        double elapsed_s = 0; ///< Processing time, excluding the wait for the memory budget
+    };
+
+    /// @brief Configures the extractor of a job, before its memory is estimated and its images are loaded
+    using SetupCb = std::function<void(const Job &, BackgroundExtractor &)>;
+
+    /// @brief Called once a job is done, e.g. to write its final image
+    /// @note It's called from the thread running the job, so it may be called by several threads at the same time
+    using DoneCb = std::function<void(const Job &, BackgroundExtractor &, const Result &)>;
+
+    /// @brief Constructor
+    /// @param resize_factor Resize factor of the extractors
+    /// @param num_threads Number of threads of the shared pool. Use all the available cores if lower than 1
+    /// @param max_concurrent_jobs Maximum number of datasets processed at the same time
+    /// @param max_bytes Global memory budget. A job exceeding it on its own still runs, but alone
+    JobRunner(float resize_factor, int num_threads, int max_concurrent_jobs, size_t max_bytes);
+
+    ~JobRunner() = default;
+
+    /// @brief Adds a dataset to the queue
+    void add_job(const Job &job);
+
+    void set_setup_callback(const SetupCb &setup_cb);
+
+    void set_done_callback(const DoneCb &done_cb);
+
+    /// @brief Processes all the jobs of the queue and empties it
+    /// @return Results, in the order of the jobs
+    std::vector<Result> run();
+
+private:
+    /// @brief Processes jobs of the queue until there are none left
+    void run_jobs();
+
+    /// @brief Processes a job, once enough memory is available
+    Result run_job(const Job &job);
+
+    /// @brief Estimates the memory needed by a job, without decoding its images entirely
+    size_t estimate_num_bytes(const Job &job, const BackgroundExtractor &extractor) const;
+
+    /// @brief Waits until some memory fits in the budget, or until no other job is running
+    void acquire_memory(size_t num_bytes);
+
+    void release_memory(size_t num_bytes);
+
+    const float resize_factor_;
+    const int max_concurrent_jobs_;
+    std::shared_ptr<ThreadPool> thread_pool_;
+    SetupCb setup_cb_;
+    DoneCb done_cb_;
+
+    std::vector<Job> jobs_;
+    std::vector<Result> results_;
+
+    std::mutex mutex_;
+    size_t next_job_id_;       ///< Protected by mutex_
+    size_t max_bytes_;
+    size_t num_reserved_bytes_; ///< Memory reserved by the running jobs. Protected by mutex_
+    int num_running_jobs_;      ///< Protected by mutex_
+    std::condition_variable memory_cv_;
+};
+
+#endif // JOB_RUNNER_H
@@ -0,0 +1,67 @@
+/*********************************************************************************************************************
+ * File : pixel_histogram.h                                                                                          *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#ifndef PIXEL_HISTOGRAM_H
+#define PIXEL_HISTOGRAM_H
+
+#include <opencv2/core/mat.hpp>
+
+/// @brief Per-pixel histogram of the grayscale intensity of a set of images, updated one image at a time
+///
+/// Its memory doesn't depend on the number of images, which makes it possible to find the intensities shared by
+/// most images, either over a sliding window of frames or over a whole dataset.
+/// Votes of a bin also count the two neighbouring bins, so that similar intensities falling on both sides of a
+/// bin boundary still agree.
+class PixelHistogram
+{
+public:
+    PixelHistogram();
+
+    ~PixelHistogram() = default;
+
+    /// @brief Allocates an empty histogram
+    /// @param size Size of the images
+    /// @param num_bins Number of bins in [2, 256]
+    void create(cv::Size size, int num_bins);
+
+    int get_num_bins() const;
+
+    /// @brief Gets the bin of each pixel of a BGR image
+    /// @param bgr_img BGR image (or band of rows)
+    /// @param bins Output bins
+    void quantize(const cv::Mat &bgr_img, cv::Mat_<uint8_t> &bins) const;
+
+    /// @brief Adds an image to the histogram
+    /// @param bins Bins of the image, restricted to the given rows
+    /// @param rows Rows of the histogram to update
+    void add(const cv::Mat_<uint8_t> &bins, const cv::Range &rows);
+
+    /// @brief Removes an image that has previously been added to the histogram
+    /// @param bins Bins of the image, restricted to the given rows
+    /// @param rows Rows of the histogram to update
+    void remove(const cv::Mat_<uint8_t> &bins, const cv::Range &rows);
+
+    /// @brief Gets the counts of all the bins of the pixels of a row
+    /// @note Counts of pixel x start at index x * get_num_bins()
+    const uint16_t *get_counts_row(int y) const;
+
+    /// @brief Gets the number of images whose intensity is in a bin or in one of its two neighbours
+    /// @param counts Counts of the pixel
+    /// @param bin Bin of the pixel
+    inline int get_votes(const uint16_t *counts, int bin) const
+    {
+        return counts[bin] + (bin > 0 ? counts[bin - 1] : 0) + (bin + 1 < num_bins_ ? counts[bin + 1] : 0);
+    }
+
+    /// @brief Gets the number of bytes used by the histogram
+    size_t get_num_bytes() const;
+
+private:
+    cv::Mat_<uint16_t> counts_; ///< Counts of the bins of each pixel, contiguous in a row
+    int num_bins_;
+};
+
+#endif // PIXEL_HISTOGRAM_H
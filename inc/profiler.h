@@ -0,0 +1,108 @@
+/*********************************************************************************************************************
+ * File : profiler.h                                                                                                 *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <ostream>
+
+/// @brief Accumulates the wall time of the processing stages, and counts the stages skipped because their inputs
+/// haven't changed
+/// @note When it's disabled, timers don't even read the clock
+/// @note All the methods are thread-safe
+class Profiler
+{
+public:
+    enum Stage
+    {
+        Load,
+        Decode,
+        Blur,
+        Diff,
+        SpeculativeDiff,
+        Threshold,
+        Morphology,
+        TiledDiff,
+        TiledUpdate,
+        Overlay,
+        Finalize,
+        Refine,
+        Compose,
+        Vote,
+        NumStages
+    };
+
+    /// @brief Measures the wall time of a stage until it goes out of scope
+    class ScopedTimer
+    {
+    public:
+        ScopedTimer(Profiler &profiler, Stage stage);
+
+        ~ScopedTimer();
+
+    private:
+        Profiler *profiler_; ///< Null if the profiler is disabled
+        Stage stage_;
+        std::chrono::steady_clock::time_point start_;
+    };
+
+    Profiler();
+
+    ~Profiler() = default;
+
+    /// @brief Enables or disables the measurements
+    void set_enabled(bool enabled);
+
+    bool is_enabled() const;
+
+    /// @brief Clears all the measurements
+    void reset();
+
+    /// @brief Adds a run of a stage
+    void add_time(Stage stage, double elapsed_ms);
+
+    /// @brief Counts a stage that hasn't been run since its result was already up to date
+    void add_skip(Stage stage);
+
+    /// @brief Gets the number of runs of a stage
+    int get_count(Stage stage) const;
+
+    /// @brief Gets the number of times a stage has been skipped
+    int get_num_skips(Stage stage) const;
+
+    /// @brief Gets the total wall time of a stage, in milliseconds
+    double get_total_ms(Stage stage) const;
+
+    /// @brief Gets the longest run of a stage, in milliseconds
+    double get_max_ms(Stage stage) const;
+
+    /// @brief Gets the name of a stage
+    static const char *get_stage_name(Stage stage);
+
+    /// @brief Gets the peak resident memory of the process, in bytes
+    static size_t get_peak_rss_bytes();
+
+    /// @brief Writes the statistics of the stages that have been run or skipped, as a JSON object
+    void write_json(std::ostream &os) const;
+
+private:
+    struct StageStats
+    {
+        int count = 0;
+        int num_skips = 0;
+        double total_ms = 0;
+        double max_ms = 0;
+    };
+
+    mutable std::mutex mutex_;
+    std::atomic<bool> enabled_; ///< Read without locking, so that disabled timers cost a single load
+    StageStats stats_[NumStages];
+};
+
+#endif // PROFILER_H
@@ -0,0 +1,100 @@
+/*********************************************************************************************************************
+ * File : streaming_background_extractor.h                                                                           *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#ifndef STREAMING_BACKGROUND_EXTRACTOR_H
+#define STREAMING_BACKGROUND_EXTRACTOR_H
+
+#include <memory>
+#include <opencv2/core/mat.hpp>
+#include <opencv2/videoio.hpp>
+
+#include "pixel_histogram.h"
+#include "thread_pool.h"
+
+/// @brief Continuously updated background of a fixed camera, estimated over a sliding window of frames
+///
+/// Each frame is blurred and its grayscale intensity quantized into bins. A per-pixel histogram counts the bins of
+/// the frames in the window, and is updated incrementally when a frame enters or leaves it. A pixel of the
+/// background takes the color of the latest frame whose bin gets at least as many votes as the bin of the current
+/// background, i.e. the color shared by most frames of the window. The cost of a frame doesn't depend on the window
+/// size, since the window is never processed again as a whole.
+class StreamingBackgroundExtractor
+{
+public:
+    /// @brief Constructor
+    /// @param window_size Number of frames in the sliding window, in [2, 65535]
+    /// @param output_period Number of frames between two background images
+    /// @param resize_factor Work with downsampled frames
+    /// @param blur_radius Blurring kernel size. The larger the radius, the less noisy the background is
+    /// @param num_bins Number of grayscale bins. The fewer the bins, the more tolerant to noise and lighting changes
+    /// @note The histogram uses 2*num_bins bytes per pixel and the window 1 byte per pixel and per frame
+    StreamingBackgroundExtractor(int window_size, int output_period, float resize_factor = 1.f, int blur_radius = 5,
+                                 int num_bins = 32);
+
+    ~StreamingBackgroundExtractor() = default;
+
+    /// @brief Opens a video file, or an image sequence (e.g. "img_%04d.jpg")
+    /// @return true if the source has been correctly opened
+    bool open(const std::string &source);
+
+    /// @brief Reads the next frame of the source and adds it to the window
+    /// @param new_background Set to true if a new background image is available
+    /// @return false at the end of the stream
+    bool read_next_frame(bool &new_background);
+
+    /// @brief Adds a frame to the window, removing the oldest one if the window is full
+    /// @param frame BGR frame
+    /// @return true if a new background image is available
+    bool push_frame(const cv::Mat &frame);
+
+    /// @brief Gets the last background image, at working resolution
+    const cv::Mat &get_background() const;
+
+    /// @brief Gets the pixels of the last background image whose color is shared by at least two frames of the
+    /// window, i.e. that are likely to belong to the background
+    const cv::Mat_<uint8_t> &get_confidence_mask() const;
+
+    /// @brief Gets the number of frames pushed since the stream has been opened
+    int get_num_frames() const;
+
+    /// @brief Sets the number of threads used to update the background
+    /// @param num_threads Number of threads. Use all the available cores if lower than 1
+    void set_num_threads(int num_threads);
+
+private:
+    /// @brief Allocates the window, the histogram and the background when the first frame comes in
+    void reset(cv::Size frame_size);
+
+    /// @brief Gets the rows of a band of the working frames
+    cv::Range get_band_rows(int band_id, int num_bands) const;
+
+    cv::VideoCapture capture_;
+    cv::Mat frame_;
+    cv::Mat resized_frame_;
+    cv::Mat blurred_frame_;
+
+    std::vector<cv::Mat_<uint8_t>> window_bins_; ///< Ring buffer of the bins of the frames in the window
+    PixelHistogram histogram_;
+
+    cv::Mat crt_background_;                ///< Background, updated at each frame
+    cv::Mat_<uint8_t> crt_background_bins_; ///< Bins of the pixels of the background
+    cv::Mat background_;                    ///< Last background image
+    cv::Mat_<uint8_t> confidence_mask_;
+
+    std::shared_ptr<ThreadPool> thread_pool_;
+
+    int num_frames_;
+    cv::Size frame_size_;
+    cv::Size working_size_;
+
+    const int window_size_;
+    const int output_period_;
+    const float resize_factor_;
+    const int blur_radius_;
+    const int num_bins_;
+};
+
+#endif // STREAMING_BACKGROUND_EXTRACTOR_H
@@ -0,0 +1,102 @@
+/*********************************************************************************************************************
+ * File : thread_pool.h                                                                                              *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// @brief Fixed set of worker threads, used both for parallel loops and for background tasks
+class ThreadPool
+{
+public:
+    /// @brief Constructor
+    /// @param num_threads Number of worker threads. Use all the available cores if lower than 1
+    explicit ThreadPool(int num_threads = 0);
+
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    /// @brief Gets the maximum number of threads running a parallel loop at the same time
+    /// @note Worker IDs given to the loop bodies are in [0, get_num_threads()[
+    int get_num_threads() const;
+
+    /// @brief Calls body(i, worker_id) for each i in [0, n[ and waits for all of them to be done
+    ///
+    /// The calling thread takes part in the loop, so that it's safe to call it from a task of the pool.
+    /// Two calls sharing the same worker ID never run at the same time, which makes it possible to use
+    /// per-worker scratch buffers.
+    ///
+    /// @note The loop doesn't allocate memory once the task queue has reached its steady-state size
+    template <typename Body>
+    void parallel_for(int n, const Body &body)
+    {
+        ParallelJob job;
+        job.n = n;
+        job.body = &body;
+        job.run = &run_body<Body>;
+        run_parallel_job(job);
+    }
+
+    /// @brief Runs a task on a worker thread
+    /// @return Future that becomes ready once the task is done
+    std::future<void> submit(std::function<void()> task);
+
+private:
+    struct ParallelJob
+    {
+        int n;
+        const void *body;
+        void (*run)(const void *body, int i, int worker_id);
+
+        std::atomic<int> next_index{0};
+        std::atomic<int> next_worker_id{0};
+        int num_pending_helpers = 0; ///< Protected by mutex_
+    };
+
+    /// @brief Either a share of a parallel loop or a standalone task
+    struct Task
+    {
+        ParallelJob *job = nullptr;
+        std::function<void()> fn;
+    };
+
+    template <typename Body>
+    static void run_body(const void *body, int i, int worker_id)
+    {
+        (*static_cast<const Body *>(body))(i, worker_id);
+    }
+
+    void run_parallel_job(ParallelJob &job);
+
+    /// @brief Processes indices of the loop until there are none left
+    static void work_on(ParallelJob &job);
+
+    /// @brief Adds a task to the queue. mutex_ must be locked
+    void push_task(Task &&task);
+
+    void worker_loop();
+
+    std::vector<std::thread> workers_;
+
+    std::mutex mutex_;
+    std::condition_variable task_cv_; ///< Notified when a task is added to the queue
+    std::condition_variable done_cv_; ///< Notified when a share of a parallel loop is done
+    std::vector<Task> tasks_;         ///< Circular buffer, growing only when it's full
+    size_t first_task_;
+    size_t num_tasks_;
+    bool stop_;
+};
+
+#endif // THREAD_POOL_H
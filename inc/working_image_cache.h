@@ -0,0 +1,71 @@
+/*********************************************************************************************************************
+ * File : working_image_cache.h                                                                                      *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#ifndef WORKING_IMAGE_CACHE_H
+#define WORKING_IMAGE_CACHE_H
+
+#include <memory>
+#include <opencv2/core/mat.hpp>
+
+namespace boost
+{
+namespace interprocess
+{
+class mapped_region;
+} // namespace interprocess
+} // namespace boost
+
+/// @brief Keeps the downsampled images of datasets on disk, so that reopening a dataset doesn't need to decode and
+/// resize its images again
+///
+/// Each dataset is stored in a single raw file, made of a versioned header, the path, modification time and size of
+/// each image file, and then the pixels of all the working images. A warm start maps this file in memory, without
+/// any decoding or copy. The cache file is ignored as soon as an image file has changed, or if it has been written
+/// with another resize factor, decoding mode or version.
+/// @note Cache files are evicted, least recently used first, once their total size exceeds the memory budget
+class WorkingImageCache
+{
+public:
+    WorkingImageCache();
+
+    ~WorkingImageCache();
+
+    /// @brief Sets the directory containing the cache files
+    /// @param dir_path Path to the directory, or an empty string to disable the cache
+    /// @param max_bytes Maximum total size of the cache files
+    void set_directory(const std::string &dir_path, size_t max_bytes);
+
+    /// @brief Maps the working images of a dataset, if they're in the cache and up to date
+    /// @param filenames Paths to the image files
+    /// @param resize_factor Resize factor of the working images
+    /// @param reduced_decoding Whether the JPEG decoder directly downsampled the images, which gives different pixels
+    /// @param imgs Output working images, pointing to read-only mapped memory
+    /// @param original_size Output size of the original images
+    /// @return true if the images have been found in the cache
+    /// @note The mapped images stay valid until the next call to load
+    bool load(const std::vector<cv::String> &filenames, float resize_factor, bool reduced_decoding,
+              std::vector<cv::Mat> &imgs, cv::Size &original_size);
+
+    /// @brief Writes the working images of a dataset to the cache
+    /// @return true if the cache file has been written
+    bool save(const std::vector<cv::String> &filenames, float resize_factor, bool reduced_decoding,
+              const std::vector<cv::Mat> &imgs, cv::Size original_size);
+
+private:
+    /// @brief Gets the path of the cache file of a dataset
+    std::string get_cache_path(const std::vector<cv::String> &filenames, float resize_factor,
+                               bool reduced_decoding) const;
+
+    /// @brief Removes the least recently used cache files, so that a new file of the given size fits in the budget
+    void evict(size_t num_bytes);
+
+    std::string dir_path_;
+    size_t max_bytes_;
+
+    std::unique_ptr<boost::interprocess::mapped_region> region_; ///< Memory of the loaded images
+};
+
+#endif // WORKING_IMAGE_CACHE_H
@@ -4,16 +4,92 @@
  * 2020 Thomas Rouch                                                                                                 *
  *********************************************************************************************************************/
 
+#include <algorithm>
 #include <assert.h>
+#include <cmath>
 #include <iostream>
+#include <limits>
+#include <opencv2/imgcodecs.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/highgui.hpp>
+#include <boost/algorithm/string/case_conv.hpp>
 #include <boost/filesystem.hpp>
 
 #include "background_extractor.h"
+#include "diff_kernel.h"
+#include "pixel_histogram.h"
 
 namespace bfs = boost::filesystem;
 
+namespace
+{
+/// @brief Gets the imread flag making the JPEG decoder directly output a downsampled image
+/// @return false if the resize factor isn't supported by the decoder
+bool get_reduced_imread_flag(float resize_factor, int &flag)
+{
+    if (resize_factor == 0.5f)
+        flag = cv::IMREAD_REDUCED_COLOR_2;
+    else if (resize_factor == 0.25f)
+        flag = cv::IMREAD_REDUCED_COLOR_4;
+    else if (resize_factor == 0.125f)
+        flag = cv::IMREAD_REDUCED_COLOR_8;
+    else
+        return false;
+    return true;
+}
+
+bool is_jpeg(const std::string &filename)
+{
+    const std::string extension = boost::algorithm::to_lower_copy(bfs::path(filename).extension().string());
+    return extension == ".jpg" || extension == ".jpeg" || extension == ".jpe";
+}
+
+/// @brief Overlay blend of each intensity of the reference image, indexed by 2 * (mask color channel is 255) +
+/// (pixel is missing in the final image)
+struct OverlayLut
+{
+    uint8_t values[4][256];
+};
+
+const OverlayLut &get_overlay_lut()
+{
+    static const OverlayLut lut = []() {
+        OverlayLut lut;
+        for (int k = 0; k < 4; k++)
+        {
+            const float color = k >= 2 ? 255.f : 0.f;
+            const float no_info_color = k % 2 ? 255.f : 0.f;
+            for (int v = 0; v < 256; v++)
+            {
+                // Same rounding as the two successive cv::addWeighted it replaces
+                const uint8_t blend = cv::saturate_cast<uint8_t>(0.7f * v + 0.3f * color);
+                lut.values[k][v] = cv::saturate_cast<uint8_t>(0.5f * blend + 0.5f * no_info_color);
+            }
+        }
+        return lut;
+    }();
+    return lut;
+}
+
+size_t get_num_bytes(const cv::Mat &img)
+{
+    return img.total() * img.elemSize();
+}
+
+size_t get_num_bytes(const std::vector<cv::Mat> &imgs)
+{
+    size_t num_bytes = 0;
+    for (const auto &img : imgs)
+        num_bytes += get_num_bytes(img);
+    return num_bytes;
+}
+/// Size of the tiles where the differences are computed again when refining the mask around its edges
+const int refine_tile_size = 64;
+} // namespace
+
+constexpr int BackgroundExtractor::order_num_bins;
+constexpr uint16_t BackgroundExtractor::no_label;
+
 BackgroundExtractor::ProcessingParams::ProcessingParams(int blur_radius,
                                                         int ths,
                                                         int open_radius,
@@ -31,17 +107,44 @@ void BackgroundExtractor::ProcessingParams::reset()
 }
 
 BackgroundExtractor::BackgroundExtractor(float resize_factor,
+                                         cv::Vec3b bg_color) : BackgroundExtractor(resize_factor,
+                                                                                   std::make_shared<ThreadPool>(0),
+                                                                                   bg_color) {}
+
+BackgroundExtractor::BackgroundExtractor(float resize_factor,
+                                         const std::shared_ptr<ThreadPool> &thread_pool,
                                          cv::Vec3b bg_color) : resize_factor_(resize_factor),
                                                                bg_color_(bg_color),
                                                                last_params_(-1, -1, -1, -1),
-                                                               crt_id_ref_(0)
+                                                               crt_id_ref_(0),
+                                                               max_blur_radius_(30),
+                                                               streaming_(false),
+                                                               reference_order_(ReferenceOrder::FileOrder),
+                                                               feather_radius_(0),
+                                                               refine_factor_(0.f),
+                                                               async_params_(-1, -1, -1, -1),
+                                                               async_generation_(0),
+                                                               async_running_(false),
+                                                               async_mask_ready_(false),
+                                                               speculative_ref_id_(-1),
+                                                               speculative_blur_radius_(-1),
+                                                               session_done_(false),
+                                                               voted_(false),
+                                                               final_img_composed_(false),
+                                                               order_blur_radius_(5),
+                                                               tile_size_(0),
+                                                               prefetched_id_(-1),
+                                                               integral_imgs_max_bytes_(size_t(2) << 30),
+                                                               loaded_from_disk_cache_(false)
 
 {
+    set_thread_pool(thread_pool);
 }
 
 bool BackgroundExtractor::load_images(const std::string &dir_path, const std::string &image_extension)
 {
     reset();
+    Profiler::ScopedTimer timer(profiler_, Profiler::Load);
 
     // Find image filenames in the directory
     std::vector<cv::String> filenames;
@@ -53,191 +156,1202 @@ bool BackgroundExtractor::load_images(const std::string &dir_path, const std::st
         std::cerr << "There's no images with a " << image_extension << " extension in the folder " << dir_path << std::endl;
         return false;
     }
+    if (n > std::numeric_limits<uint16_t>::max())
+    {
+        std::cerr << "There are too many images in the folder " << dir_path << std::endl;
+        return false;
+    }
 
-    // Load images
-    original_imgs_.reserve(n);
-    for (size_t i = 0; i < n; i++)
-        original_imgs_.emplace_back(cv::imread(filenames[i]));
+    filenames_ = filenames;
+    if (!streaming_)
+        original_imgs_.resize(n);
+    // Only the streaming mode lets the JPEG decoder downsample the images
+    loaded_from_disk_cache_ = working_imgs_cache_.load(filenames, resize_factor_, streaming_, resized_imgs_,
+                                                       original_size_);
+    if (loaded_from_disk_cache_)
+    {
+        // Full-resolution images are only decoded when they're needed
+        height_ = resized_imgs_[0].rows;
+        width_ = resized_imgs_[0].cols;
+    }
+    else
+    {
+        if (!decode_images())
+            return false;
+        working_imgs_cache_.save(filenames, resize_factor_, streaming_, resized_imgs_, original_size_);
+    }
 
-    original_size_ = original_imgs_[0].size();
+    // Summed-area tables make any blur radius cost O(1) per pixel, as long as they fit in the memory budget.
+    // The tiled mode blurs tiles on the fly instead
+    integral_imgs_.resize(n);
+    if (tile_size_ <= 0 && n * IntegralImage::get_num_bytes(cv::Size(width_, height_), max_blur_radius_) <= integral_imgs_max_bytes_)
+        thread_pool_->parallel_for(n, [&](int i, int) { integral_imgs_[i].compute(resized_imgs_[i], max_blur_radius_); });
 
-    // Make sure they all have the same size
-    for (const auto &img : original_imgs_)
+    // Pre allocate the buffers of update_mask, so that tuning the parameters doesn't allocate memory
+    blurred_imgs_.resize(n);
+    min_diff_.create(height_, width_);
+    mask_.create(height_, width_);
+    if (tile_size_ <= 0)
     {
-        if (img.size() != original_size_)
-        {
-            std::cerr << "Images must all have the same size." << std::endl;
-            return false;
-        }
+        best_match_ids_.create(height_, width_);
+        speculative_min_diff_.create(height_, width_);
+        speculative_best_match_ids_.create(height_, width_);
+        mask_before_morph_.create(height_, width_);
+        morphology_.reserve(cv::Size(width_, height_), thread_pool_->get_num_threads());
     }
 
-    // Resize images
-    height_ = int(resize_factor_ * original_size_.height);
-    width_ = int(resize_factor_ * original_size_.width);
-    resized_imgs_.reserve(n);
-    for (size_t i = 0; i < n; i++)
+    // Refined masks are computed at a higher resolution than the working one
+    if (refine_factor_ > resize_factor_)
+        label_size_ = cv::Size(int(refine_factor_ * original_size_.width), int(refine_factor_ * original_size_.height));
+    else
+        label_size_ = cv::Size(width_, height_);
+
+    // Votes used to sort the reference images
+    if (reference_order_ == ReferenceOrder::Coverage)
     {
-        cv::Mat resized_img;
-        cv::resize(original_imgs_[i], resized_img, cv::Size(width_, height_), cv::INTER_AREA);
-        resized_imgs_.emplace_back(std::move(resized_img));
+        order_histogram_.create(cv::Size(width_, height_), order_num_bins);
+        count_blurred_bins(order_blur_radius_, order_histogram_, &order_bins_);
     }
 
-    // Pre allocate images containing the differences
-    uchar_blurred_diffs_.reserve(n - 1);
-    for (size_t i = 0; i < n - 1; i++)
-        uchar_blurred_diffs_.emplace_back(width_, height_);
+    rewind();
+    return true;
+}
 
-    // Set the first reference image
-    crt_id_ref_ = 0;
-    last_params_.reset();
+bool BackgroundExtractor::decode_images()
+{
+    Profiler::ScopedTimer timer(profiler_, Profiler::Decode);
+
+    // Load and resize images in parallel. Each task writes at its own index to keep the order of the filenames
+    const std::vector<cv::String> &filenames = filenames_;
+    const int n = filenames.size();
+    resized_imgs_.resize(n);
+    std::vector<cv::Size> original_sizes(n);
+    int reduced_imread_flag;
+    const bool reduced_imread = streaming_ && get_reduced_imread_flag(resize_factor_, reduced_imread_flag);
+    thread_pool_->parallel_for(n, [&](int i, int) {
+        // The JPEG decoder directly outputs the downsampled image, without decoding full-size pixels. It resamples
+        // differently than cv::resize, so all the images of the dataset have to go through it
+        const bool reduced = reduced_imread && is_jpeg(filenames[i]);
+        if (reduced)
+            resized_imgs_[i] = cv::imread(filenames[i], reduced_imread_flag);
+
+        // The first image is still decoded at full resolution, to get the original size
+        if (reduced && i > 0)
+            return;
+        const cv::Mat original_img = cv::imread(filenames[i]);
+        if (original_img.empty())
+            return;
+        original_sizes[i] = original_img.size();
+        if (reduced)
+            return;
+
+        // Without downsampling, the working image shares its data with the original one
+        const cv::Size resized_size(int(resize_factor_ * original_img.cols), int(resize_factor_ * original_img.rows));
+        if (resized_size == original_img.size())
+            resized_imgs_[i] = original_img;
+        else
+            cv::resize(original_img, resized_imgs_[i], resized_size, 0, 0, cv::INTER_AREA);
+        if (!streaming_)
+            original_imgs_[i] = original_img;
+    });
+
+    original_size_ = original_sizes[0];
+    height_ = int(resize_factor_ * original_size_.height);
+    width_ = int(resize_factor_ * original_size_.width);
+
+    // Make sure they all have been read and have the same size
+    const cv::Size reduced_size(int(std::ceil(resize_factor_ * original_size_.width)),
+                                int(std::ceil(resize_factor_ * original_size_.height)));
+    for (int i = 0; i < n; i++)
+    {
+        if (resized_imgs_[i].empty())
+        {
+            std::cerr << "Unable to read the image " << filenames[i] << std::endl;
+            return false;
+        }
+
+        // Reduced JPEG decoding rounds the size up
+        const bool reduced = reduced_imread && is_jpeg(filenames[i]);
+        const bool same_size = reduced ? resized_imgs_[i].size() == reduced_size : original_sizes[i] == original_size_;
+        if (!same_size)
+        {
+            std::cerr << "Images must all have the same size." << std::endl;
+            return false;
+        }
+        if (resized_imgs_[i].cols != width_ || resized_imgs_[i].rows != height_)
+            cv::resize(resized_imgs_[i].clone(), resized_imgs_[i], cv::Size(width_, height_), 0, 0, cv::INTER_AREA);
+    }
+    return true;
+}
 
-    // Init final image
+void BackgroundExtractor::rewind()
+{
+    // Init final image, and its preview sharing its data when there's no downsampling
     final_img_.create(original_size_.height, original_size_.width, CV_8UC3);
     final_img_.setTo(bg_color_);
+    if (original_size_ == cv::Size(width_, height_))
+        preview_img_ = final_img_;
+    else
+    {
+        preview_img_.create(height_, width_, CV_8UC3);
+        preview_img_.setTo(bg_color_);
+    }
+    session_done_ = false;
+    voted_ = false;
+    final_img_composed_ = false;
+
+    label_map_.create(label_size_);
+    label_map_.setTo(no_label);
+    tmp_mask_.create(height_, width_);
 
     no_info_mask_.create(height_, width_);
     no_info_mask_.setTo(cv::Scalar(255));
-    return true;
+    if (label_size_ == no_info_mask_.size())
+        label_no_info_mask_ = no_info_mask_;
+    else
+    {
+        label_no_info_mask_.create(label_size_);
+        label_no_info_mask_.setTo(cv::Scalar(255));
+    }
+
+    // Set the first reference image
+    speculative_ref_id_ = -1;
+    used_refs_.assign(resized_imgs_.size(), false);
+    select_next_reference();
+    last_params_.reset();
+    valid_mask_ = false;
 }
 
 void BackgroundExtractor::update_mask(const ProcessingParams &params)
 {
-    assert(!uchar_blurred_diffs_.empty());
+    compute_mask(params, -1);
+}
+
+bool BackgroundExtractor::compute_mask(const ProcessingParams &params, int generation)
+{
+    assert(resized_imgs_.size() > 1);
+    if (voted_)
+        return false;
+
+    if (tile_size_ > 0)
+    {
+        // The minimum difference is kept for the whole image, so that only a new blur radius or a new reference
+        // image blurs the images again
+        if (params.blur_radius != last_params_.blur_radius)
+        {
+            last_params_.reset();
+            Profiler::ScopedTimer timer(profiler_, Profiler::TiledDiff);
+            compute_min_diff_tiled(params.blur_radius);
+            last_params_.blur_radius = params.blur_radius;
+        }
+        else
+            profiler_.add_skip(Profiler::TiledDiff);
 
-    bool has_changed = false;
-    // 1) Blur (Update uchar_blurred_diffs_)
+        if (params.ths != last_params_.ths || params.open_radius != last_params_.open_radius || params.num_final_erosions != last_params_.num_final_erosions)
+        {
+            Profiler::ScopedTimer timer(profiler_, Profiler::TiledUpdate);
+            update_mask_tiled(params);
+        }
+        else
+            profiler_.add_skip(Profiler::TiledUpdate);
+        last_params_ = params;
+        valid_mask_ = true;
+        return true;
+    }
+
+    // last_params_ is updated after each stage, so that a cancelled update resumes from the last completed one
+
+    // 1) Blur (Update min_diff_ and best_match_ids_)
     if (params.blur_radius != last_params_.blur_radius)
     {
-        // Apply blur on the reference image
-        const cv::Size kernel_blur(2 * params.blur_radius + 1, 2 * params.blur_radius + 1);
-        cv::blur(resized_imgs_[crt_id_ref_], tmp_blurred_ref_, kernel_blur);
+        last_params_.reset();
 
-        // Compute the intensity of the blurred difference against all other images
-        for (size_t i = 0; i < resized_imgs_.size(); i++)
+        // Blurred images are cached, so that they're computed only once per radius for the whole session
         {
-            if (i != crt_id_ref_)
-            {
-                // Keep uchar images
-                cv::blur(resized_imgs_[i], tmp_cv8uc3_, kernel_blur);
-                cv::absdiff(tmp_blurred_ref_, tmp_cv8uc3_, tmp_cv8uc3_);
-                auto &dst = uchar_blurred_diffs_[img_to_diff_id(i)];
-                cv::cvtColor(tmp_cv8uc3_, dst, cv::COLOR_BGR2GRAY);
-            }
+            Profiler::ScopedTimer timer(profiler_, Profiler::Blur);
+            thread_pool_->parallel_for(resized_imgs_.size(), [&](int i, int) {
+                if (!is_cancelled(generation))
+                    get_blurred_img(i, params.blur_radius, blurred_imgs_[i]);
+            });
+        }
+        if (is_cancelled(generation))
+            return false;
+
+        Profiler::ScopedTimer timer(profiler_, Profiler::Diff);
+
+        if (speculative_ref_id_ == crt_id_ref_ && speculative_blur_radius_ == params.blur_radius)
+        {
+            // Already computed while the previous reference image was tuned
+            cv::swap(min_diff_, speculative_min_diff_);
+            cv::swap(best_match_ids_, speculative_best_match_ids_);
+            speculative_ref_id_ = -1;
         }
-        has_changed = true;
+        else if (!compute_min_diff(crt_id_ref_, min_diff_, best_match_ids_, generation))
+            return false;
+        last_params_.blur_radius = params.blur_radius;
     }
+    else
+        profiler_.add_skip(Profiler::Blur);
 
     // 2) Threshold (update mask_before_morph_)
-    if (has_changed || params.ths != last_params_.ths)
+    if (params.ths != last_params_.ths)
     {
+        Profiler::ScopedTimer timer(profiler_, Profiler::Threshold);
+        const int num_bands = get_num_bands();
+        thread_pool_->parallel_for(num_bands, [&](int band_id, int) {
+            const cv::Range rows = get_band_rows(band_id, num_bands);
+            for (int y = rows.start; y < rows.end; y++)
+            {
+                const uint8_t *min_diff_row = min_diff_[y];
+                uint8_t *mask_row = mask_before_morph_[y];
+                for (int x = 0; x < width_; x++)
+                    mask_row[x] = min_diff_row[x] <= params.ths ? 255 : 0; // 255 if below ths
+            }
+        });
 
-        // Reset mask
-        mask_before_morph_.create(height_, width_);
-        mask_before_morph_.setTo(0);
-        tmp_mask_.create(height_, width_);
+        // Distance maps only depend on the mask before morphology (and on the opening radius)
+        morphology_.set_mask(mask_before_morph_);
+        last_params_.ths = params.ths;
+        last_params_.open_radius = -1;
+    }
+    else
+        profiler_.add_skip(Profiler::Threshold);
+
+    // 3) Open and Dilate (update mask_)
+    if (params.open_radius != last_params_.open_radius || params.num_final_erosions != last_params_.num_final_erosions)
+    {
+        if (is_cancelled(generation))
+            return false;
+        Profiler::ScopedTimer timer(profiler_, Profiler::Morphology);
+        morphology_.apply(*thread_pool_, params.open_radius, params.num_final_erosions, mask_);
+        last_params_.open_radius = params.open_radius;
+        last_params_.num_final_erosions = params.num_final_erosions;
+    }
+    else
+        profiler_.add_skip(Profiler::Morphology);
+
+    valid_mask_ = true;
+    return true;
+}
+
+bool BackgroundExtractor::compute_min_diff(int ref_id, cv::Mat_<uint8_t> &min_diff, cv::Mat_<uint16_t> &best_match_ids,
+                                           int generation)
+{
+    min_diff.create(height_, width_);
+    best_match_ids.create(height_, width_);
 
-        for (int k = 0; k < resized_imgs_.size() - 1; k++)
+    // Keep the smallest intensity of the blurred differences against all other images. Thresholding it is
+    // the same as thresholding each difference and merging the masks using a logical OR.
+    // Tiles are small enough for their rows to stay in the L2 cache while all the images are compared
+    const int tile_height = std::max(size_t(1), diff_tile_max_bytes / (diff_kernel_bytes_per_pixel * width_));
+    const int num_tiles = std::max(get_num_bands(), (height_ + tile_height - 1) / tile_height);
+    thread_pool_->parallel_for(num_tiles, [&](int tile_id, int) {
+        if (is_cancelled(generation))
+            return;
+        const cv::Range rows = get_band_rows(tile_id, num_tiles);
+        min_diff.rowRange(rows.start, rows.end).setTo(255);
+        best_match_ids.rowRange(rows.start, rows.end).setTo(ref_id);
+        for (size_t i = 0; i < resized_imgs_.size(); i++)
         {
-            // Compute the mask by applying a threshold on the grayscale blurred difference
-            tmp_mask_.setTo(0);
-            cv::threshold(uchar_blurred_diffs_[k], tmp_mask_, params.ths, 255, cv::THRESH_BINARY_INV); // 255 if below ths
+            if (i == ref_id)
+                continue;
 
-            // If an area in a mask_k is white, then it should also be white in the final mask
-            cv::bitwise_or(mask_before_morph_, tmp_mask_, mask_before_morph_);
+            // Fused absdiff, grayscale conversion and minimum, without intermediate images
+            for (int y = rows.start; y < rows.end; y++)
+                update_min_gray_absdiff(blurred_imgs_[ref_id].ptr<uint8_t>(y), blurred_imgs_[i].ptr<uint8_t>(y),
+                                        width_, i, min_diff[y], best_match_ids[y]);
         }
-        has_changed = true;
+    });
+    return !is_cancelled(generation);
+}
+
+void BackgroundExtractor::request_mask_update(const ProcessingParams &params)
+{
+    std::lock_guard<std::mutex> lock(async_mutex_);
+    async_params_ = params;
+    async_generation_++; // Cancel the work in progress
+    async_mask_ready_ = false;
+    if (!async_running_)
+    {
+        async_running_ = true;
+        async_done_ = thread_pool_->submit([this]() { run_async_updates(); });
     }
+}
 
-    // 3) Open and Dilate (update mask_)
-    if (has_changed || params.ths != last_params_.ths || params.open_radius != last_params_.open_radius || params.num_final_erosions != last_params_.num_final_erosions)
+bool BackgroundExtractor::poll_mask_update()
+{
+    std::lock_guard<std::mutex> lock(async_mutex_);
+    return async_mask_ready_;
+}
+
+void BackgroundExtractor::wait_mask_update()
+{
+    if (async_done_.valid())
+        async_done_.get();
+}
+
+void BackgroundExtractor::run_async_updates()
+{
+    while (true)
     {
-        mask_before_morph_.copyTo(mask_);
+        ProcessingParams params(-1, -1, -1, -1);
+        int generation;
+        {
+            std::lock_guard<std::mutex> lock(async_mutex_);
+            params = async_params_;
+            generation = async_generation_;
+        }
+
+        if (compute_mask(params, generation))
+        {
+            {
+                std::lock_guard<std::mutex> lock(async_mutex_);
+                if (generation == async_generation_)
+                    async_mask_ready_ = true;
+            }
 
-        // Opening (to remove small areas)
-        const cv::Mat opening_kernel = cv::getStructuringElement(cv::MORPH_ELLIPSE,
-                                                                 cv::Size(2 * params.open_radius + 1, 2 * params.open_radius + 1),
-                                                                 cv::Point(params.open_radius, params.open_radius));
-        if (params.open_radius > 0)
+            // While the user tunes the current reference image, prepare the next one
+            if (tile_size_ <= 0)
+                compute_speculative_min_diff(params.blur_radius, generation);
+        }
+
+        std::lock_guard<std::mutex> lock(async_mutex_);
+        if (generation == async_generation_)
         {
-            cv::erode(mask_, mask_, opening_kernel);
-            cv::dilate(mask_, mask_, opening_kernel);
+            async_running_ = false;
+            return;
         }
+    }
+}
 
-        // Erosion (make areas grow)
-        const cv::Mat erosion_kernel = cv::getStructuringElement(cv::MORPH_ELLIPSE,
-                                                                 cv::Size(5, 5),
-                                                                 cv::Point(1, 1));
-        for (size_t i = 0; i < params.num_final_erosions; i++)
-            cv::erode(mask_, mask_, erosion_kernel);
+void BackgroundExtractor::compute_speculative_min_diff(int blur_radius, int generation)
+{
+    const int next_ref_id = find_next_reference(crt_id_ref_);
+    if (next_ref_id < 0 || (next_ref_id == speculative_ref_id_ && blur_radius == speculative_blur_radius_))
+        return;
 
-        valid_mask_ = true;
+    // Blurred images are already at this radius, since the current mask has just been computed
+    Profiler::ScopedTimer timer(profiler_, Profiler::SpeculativeDiff);
+    speculative_ref_id_ = -1;
+    if (compute_min_diff(next_ref_id, speculative_min_diff_, speculative_best_match_ids_, generation))
+    {
+        speculative_ref_id_ = next_ref_id;
+        speculative_blur_radius_ = blur_radius;
     }
+}
 
-    // Keep in memory last processing parameters
-    last_params_ = params;
+bool BackgroundExtractor::is_cancelled(int generation) const
+{
+    return generation >= 0 && generation != async_generation_;
 }
 
 BackgroundExtractor::Status BackgroundExtractor::finalize_mask()
 {
+    // Let the asynchronous update, and the speculative one of the next reference, complete
+    wait_mask_update();
+    if (voted_)
+        return Status::Fail;
     assert(valid_mask_);
     valid_mask_ = false;
+    Profiler::ScopedTimer timer(profiler_, Profiler::Finalize);
+
+    // Only record which image owns the new pixels. The full-resolution image is composed once at the end
+    const bool refining = label_size_ != mask_.size();
+    const int num_bands = get_num_bands();
+    thread_pool_->parallel_for(num_bands, [&](int band_id, int) {
+        const cv::Range rows = get_band_rows(band_id, num_bands);
+        const cv::Mat_<uint8_t> band_mask = mask_.rowRange(rows.start, rows.end);
+        cv::Mat_<uint8_t> band_new_pixels = tmp_mask_.rowRange(rows.start, rows.end);
 
-    // Overwrite final image using the mask (only areas that haven't been updated yet)
-    cv::bitwise_and(mask_, no_info_mask_, tmp_mask_);
-    cv::resize(tmp_mask_, original_size_mask_, original_size_, cv::INTER_CUBIC);
-    original_imgs_[crt_id_ref_].copyTo(final_img_, original_size_mask_);
+        // Only areas that haven't been updated yet
+        cv::bitwise_and(band_mask, no_info_mask_.rowRange(rows.start, rows.end), band_new_pixels);
+        resized_imgs_[crt_id_ref_].rowRange(rows.start, rows.end).copyTo(preview_img_.rowRange(rows.start, rows.end), band_new_pixels);
+        if (refining)
+            return;
+        label_map_.rowRange(rows.start, rows.end).setTo(crt_id_ref_, band_new_pixels);
 
-    // Update no info mask
-    no_info_mask_.setTo(0, mask_);
+        // Update no info mask
+        no_info_mask_.rowRange(rows.start, rows.end).setTo(0, band_mask);
+    });
+    if (refining)
+        update_refined_labels();
 
     // Check if all the pixels have been recovered
-    if (cv::countNonZero(no_info_mask_) < 1)
+    session_done_ = true;
+    if (cv::countNonZero(label_no_info_mask_) < 1)
         return Status::Success;
 
     // Set the next reference image
-    crt_id_ref_++;
+    used_refs_[crt_id_ref_] = true;
     last_params_.reset();
 
-    if (crt_id_ref_ < resized_imgs_.size())
+    if (select_next_reference())
+    {
+        session_done_ = false;
         return Status::Continue;
+    }
     else
         return Status::Fail;
 }
 
+void BackgroundExtractor::update_refined_labels()
+{
+    Profiler::ScopedTimer timer(profiler_, Profiler::Refine);
+
+    // Upsampling the mask only smears the decision along its edges, so the differences are only computed again in
+    // a band around them, at the label resolution
+    cv::dilate(mask_, coarse_edges_, cv::Mat());
+    cv::erode(mask_, tmp_mask_, cv::Mat());
+    cv::subtract(coarse_edges_, tmp_mask_, coarse_edges_);
+    cv::resize(mask_, refined_mask_, label_size_, 0, 0, cv::INTER_NEAREST);
+    cv::resize(coarse_edges_, refined_edges_, label_size_, 0, 0, cv::INTER_NEAREST);
+
+    // The refinement only tightens the mask, on pixels that haven't been recovered yet
+    cv::bitwise_and(refined_edges_, refined_mask_, refined_edges_);
+    cv::bitwise_and(refined_edges_, label_no_info_mask_, refined_edges_);
+
+    // Differences are only computed in the tiles crossed by the edges. Blurring views of the images gives the same
+    // values as blurring them entirely, since filters read the pixels around the views
+    const cv::Rect label_rect(cv::Point(), label_size_);
+    refined_tiles_.clear();
+    for (int y = 0; y < label_size_.height; y += refine_tile_size)
+    {
+        for (int x = 0; x < label_size_.width; x += refine_tile_size)
+        {
+            const cv::Rect tile = cv::Rect(x, y, refine_tile_size, refine_tile_size) & label_rect;
+            if (cv::countNonZero(refined_edges_(tile)) > 0)
+                refined_tiles_.push_back(tile);
+        }
+    }
+
+    const int n = resized_imgs_.size();
+    const int blur_radius = cvRound(last_params_.blur_radius * refine_factor_ / resize_factor_);
+    const cv::Size kernel_blur(2 * blur_radius + 1, 2 * blur_radius + 1);
+    refined_min_diff_.create(label_size_);
+    refined_blurred_ref_.create(label_size_, CV_8UC3);
+
+    // The reference image comes first, since the other ones are compared against it
+    std::vector<int> img_ids(1, crt_id_ref_);
+    for (int i = 0; i < n; i++)
+        if (i != crt_id_ref_)
+            img_ids.push_back(i);
+    if (refined_tiles_.empty())
+        img_ids.clear();
+    else if (!streaming_)
+        thread_pool_->parallel_for(n, [&](int i, int) { get_original_img(i); });
+
+    for (size_t k = 0; k < img_ids.size(); k++)
+    {
+        // In streaming mode, full-resolution images are decoded one at a time, while the next one is decoded in the
+        // background
+        const cv::Mat original_img = get_original_img(img_ids[k]);
+        if (k + 1 < img_ids.size())
+            prefetch_original_img(img_ids[k + 1]);
+        cv::Mat refined_img = original_img;
+        if (original_img.size() != label_size_)
+        {
+            cv::resize(original_img, refined_img_, label_size_, 0, 0, cv::INTER_AREA);
+            refined_img = refined_img_;
+        }
+
+        thread_pool_->parallel_for(refined_tiles_.size(), [&](int tile_id, int worker_id) {
+            const cv::Rect &tile = refined_tiles_[tile_id];
+            if (k == 0)
+            {
+                cv::Mat blurred_ref = refined_blurred_ref_(tile);
+                cv::blur(refined_img(tile), blurred_ref, kernel_blur);
+                refined_min_diff_(tile).setTo(255);
+                return;
+            }
+
+            auto &buffers = tile_buffers_[worker_id];
+            cv::blur(refined_img(tile), buffers.blurred_img, kernel_blur);
+            buffers.best_match_ids.create(tile.size());
+            for (int y = 0; y < tile.height; y++)
+                update_min_gray_absdiff(refined_blurred_ref_.ptr<uint8_t>(tile.y + y) + 3 * tile.x,
+                                        buffers.blurred_img.ptr<uint8_t>(y), tile.width, img_ids[k],
+                                        refined_min_diff_[tile.y + y] + tile.x, buffers.best_match_ids[y]);
+        });
+    }
+
+    const int num_bands = std::min(label_size_.height, 4 * thread_pool_->get_num_threads());
+    thread_pool_->parallel_for(num_bands, [&](int band_id, int) {
+        const int y_begin = band_id * label_size_.height / num_bands;
+        const int y_end = (band_id + 1) * label_size_.height / num_bands;
+        for (int y = y_begin; y < y_end; y++)
+        {
+            const uint8_t *edges_row = refined_edges_[y];
+            const uint8_t *min_diff_row = refined_min_diff_[y];
+            uint8_t *mask_row = refined_mask_[y];
+            for (int x = 0; x < label_size_.width; x++)
+                if (edges_row[x] && min_diff_row[x] > last_params_.ths)
+                    mask_row[x] = 0;
+        }
+
+        const cv::Range rows(y_begin, y_end);
+        cv::Mat_<uint8_t> band_new_pixels;
+        cv::bitwise_and(refined_mask_.rowRange(rows.start, rows.end), label_no_info_mask_.rowRange(rows.start, rows.end), band_new_pixels);
+        label_map_.rowRange(rows.start, rows.end).setTo(crt_id_ref_, band_new_pixels);
+        label_no_info_mask_.rowRange(rows.start, rows.end).setTo(0, refined_mask_.rowRange(rows.start, rows.end));
+    });
+
+    // Pixels of the working images are missing as soon as one of their refined pixels is
+    cv::resize(label_no_info_mask_, no_info_mask_, no_info_mask_.size(), 0, 0, cv::INTER_AREA);
+    cv::threshold(no_info_mask_, no_info_mask_, 0, 255, cv::THRESH_BINARY);
+}
+
+void BackgroundExtractor::compose_final_image()
+{
+    Profiler::ScopedTimer timer(profiler_, Profiler::Compose);
+    const bool feathering = feather_radius_ > 0 && !streaming_;
+    if (feather_radius_ > 0 && streaming_)
+        std::cerr << "Feathering isn't available in streaming mode" << std::endl;
+
+    // Without downsampling, the preview already is the final image
+    if (preview_img_.data == final_img_.data && !feathering)
+        return;
+
+    // Nearest pixels in the label map
+    const int label_width = label_size_.width;
+    const int label_height = label_size_.height;
+    std::vector<int> label_xs(original_size_.width);
+    for (int x = 0; x < original_size_.width; x++)
+        label_xs[x] = std::min(label_width - 1, int((x + 0.5f) * label_width / original_size_.width));
+
+    // Images owning at least one pixel
+    std::vector<bool> used_labels(resized_imgs_.size(), false);
+    for (int y = 0; y < label_height; y++)
+    {
+        const uint16_t *labels_row = label_map_[y];
+        for (int x = 0; x < label_width; x++)
+            if (labels_row[x] != no_label)
+                used_labels[labels_row[x]] = true;
+    }
+    std::vector<int> used_ids;
+    for (int i = 0; i < used_labels.size(); i++)
+        if (used_labels[i])
+            used_ids.push_back(i);
+
+    if (streaming_)
+    {
+        // Full-resolution images are decoded one at a time, while the next one is decoded in the background
+        final_img_.setTo(bg_color_);
+        cv::Mat_<uint8_t> label_mask;
+        for (int k = 0; k < used_ids.size(); k++)
+        {
+            const cv::Mat original_img = get_original_img(used_ids[k]);
+            if (k + 1 < used_ids.size())
+                prefetch_original_img(used_ids[k + 1]);
+            cv::compare(label_map_, used_ids[k], label_mask, cv::CMP_EQ);
+            cv::resize(label_mask, original_size_mask_, original_size_, 0, 0, cv::INTER_NEAREST);
+            original_img.copyTo(final_img_, original_size_mask_);
+        }
+        return;
+    }
+
+    thread_pool_->parallel_for(used_ids.size(), [&](int k, int) { get_original_img(used_ids[k]); });
+
+    // Labels are only blended where several of them lie within the feathering radius
+    cv::Mat_<uint16_t> min_labels, max_labels;
+    if (feathering)
+    {
+        const cv::Mat kernel = cv::Mat::ones(2 * feather_radius_ + 1, 2 * feather_radius_ + 1, CV_8U);
+        cv::erode(label_map_, min_labels, kernel);
+        cv::dilate(label_map_, max_labels, kernel);
+    }
+
+    const int num_bands = get_num_bands();
+    thread_pool_->parallel_for(num_bands, [&](int band_id, int) {
+        const int y_begin = band_id * original_size_.height / num_bands;
+        const int y_end = (band_id + 1) * original_size_.height / num_bands;
+        for (int y = y_begin; y < y_end; y++)
+        {
+            const int label_y = std::min(label_height - 1, int((y + 0.5f) * label_height / original_size_.height));
+            const uint16_t *labels_row = label_map_[label_y];
+            cv::Vec3b *final_row = final_img_.ptr<cv::Vec3b>(y);
+            for (int x = 0; x < original_size_.width; x++)
+            {
+                const int label_x = label_xs[x];
+                const uint16_t label = labels_row[label_x];
+                if (label == no_label)
+                {
+                    final_row[x] = bg_color_;
+                    continue;
+                }
+                if (!feathering || min_labels(label_y, label_x) == max_labels(label_y, label_x))
+                {
+                    final_row[x] = original_imgs_[label].at<cv::Vec3b>(y, x);
+                    continue;
+                }
+
+                // Average the images owning the neighbouring pixels, i.e. weight each image by its share of the
+                // neighbourhood
+                int sum[3] = {0, 0, 0};
+                int count = 0;
+                for (int yy = std::max(0, label_y - feather_radius_); yy <= std::min(label_height - 1, label_y + feather_radius_); yy++)
+                {
+                    const uint16_t *neighbour_labels_row = label_map_[yy];
+                    for (int xx = std::max(0, label_x - feather_radius_); xx <= std::min(label_width - 1, label_x + feather_radius_); xx++)
+                    {
+                        if (neighbour_labels_row[xx] == no_label)
+                            continue;
+                        const cv::Vec3b &color = original_imgs_[neighbour_labels_row[xx]].at<cv::Vec3b>(y, x);
+                        for (int c = 0; c < 3; c++)
+                            sum[c] += color[c];
+                        count++;
+                    }
+                }
+                for (int c = 0; c < 3; c++)
+                    final_row[x][c] = (sum[c] + count / 2) / count;
+            }
+        }
+    });
+}
+
+BackgroundExtractor::Status BackgroundExtractor::vote_final_image(int blur_radius, int num_bins)
+{
+    assert(resized_imgs_.size() > 1);
+    wait_mask_update();
+    Profiler::ScopedTimer timer(profiler_, Profiler::Vote);
+    const int n = resized_imgs_.size();
+
+    // 1) Count the grayscale bins of all the blurred images
+    PixelHistogram histogram;
+    histogram.create(cv::Size(width_, height_), num_bins);
+    count_blurred_bins(blur_radius, histogram);
+    const int num_bands = get_num_bands();
+
+    // 2) Select the first image whose bin gets the most votes. Pixels that don't agree with any other image are
+    // left uncovered. The vote happens at the working resolution, even if labels are refined
+    cv::Mat_<uint16_t> labels = label_map_;
+    if (label_size_ != no_info_mask_.size())
+        labels.create(height_, width_);
+    thread_pool_->parallel_for(num_bands, [&](int band_id, int) {
+        const cv::Range rows = get_band_rows(band_id, num_bands);
+        cv::Mat_<uint8_t> bins;
+        cv::Mat_<uint16_t> best_votes(rows.size(), width_, uint16_t(0));
+        for (int i = 0; i < n; i++)
+        {
+            histogram.quantize(blurred_imgs_[i].rowRange(rows.start, rows.end), bins);
+            for (int y = rows.start; y < rows.end; y++)
+            {
+                const uint16_t *counts_row = histogram.get_counts_row(y);
+                const uint8_t *bins_row = bins[y - rows.start];
+                uint16_t *best_votes_row = best_votes[y - rows.start];
+                uint16_t *labels_row = labels[y];
+                for (int x = 0; x < width_; x++)
+                {
+                    const int votes = histogram.get_votes(counts_row + x * num_bins, bins_row[x]);
+                    if (votes > best_votes_row[x])
+                    {
+                        best_votes_row[x] = std::min(votes, int(std::numeric_limits<uint16_t>::max()));
+                        labels_row[x] = i;
+                    }
+                }
+            }
+        }
+        // The preview is the final image itself without downsampling, so it has to follow the labels too
+        for (int y = rows.start; y < rows.end; y++)
+        {
+            const uint16_t *best_votes_row = best_votes[y - rows.start];
+            uint8_t *no_info_row = no_info_mask_[y];
+            uint16_t *labels_row = labels[y];
+            cv::Vec3b *preview_row = preview_img_.ptr<cv::Vec3b>(y);
+            for (int x = 0; x < width_; x++)
+            {
+                no_info_row[x] = best_votes_row[x] < 2 ? 255 : 0;
+                if (no_info_row[x])
+                    labels_row[x] = no_label;
+                preview_row[x] = no_info_row[x] ? bg_color_ : resized_imgs_[labels_row[x]].at<cv::Vec3b>(y, x);
+            }
+        }
+    });
+    if (labels.data != label_map_.data)
+    {
+        cv::resize(labels, label_map_, label_size_, 0, 0, cv::INTER_NEAREST);
+        cv::resize(no_info_mask_, label_no_info_mask_, label_size_, 0, 0, cv::INTER_NEAREST);
+    }
+
+    // The manual flow has nothing left to do
+    voted_ = true;
+    valid_mask_ = false;
+    session_done_ = true;
+    final_img_composed_ = false;
+    return cv::countNonZero(no_info_mask_) < 1 ? Status::Success : Status::Fail;
+}
+
+BackgroundExtractor::~BackgroundExtractor()
+{
+    // The asynchronous and prefetching tasks write into this object
+    async_generation_++;
+    wait_mask_update();
+    wait_prefetch();
+}
+
+void BackgroundExtractor::set_num_threads(int num_threads)
+{
+    set_thread_pool(std::make_shared<ThreadPool>(num_threads));
+}
+
+void BackgroundExtractor::set_thread_pool(const std::shared_ptr<ThreadPool> &thread_pool)
+{
+    wait_mask_update();
+    wait_prefetch();
+    thread_pool_ = thread_pool;
+    tile_buffers_.resize(thread_pool_->get_num_threads());
+}
+
+void BackgroundExtractor::set_tile_size(int tile_size)
+{
+    tile_size_ = tile_size;
+    last_params_.reset();
+}
+
+void BackgroundExtractor::set_reference_order(ReferenceOrder order, int blur_radius)
+{
+    reference_order_ = order;
+    order_blur_radius_ = blur_radius;
+}
+
+void BackgroundExtractor::set_refinement(float refine_factor)
+{
+    refine_factor_ = refine_factor;
+}
+
+void BackgroundExtractor::set_disk_cache(const std::string &dir_path, size_t max_bytes)
+{
+    working_imgs_cache_.set_directory(dir_path, max_bytes);
+}
+
+void BackgroundExtractor::set_streaming(bool streaming)
+{
+    streaming_ = streaming;
+}
+
+void BackgroundExtractor::set_morphology_engine(MaskMorphology::Engine engine)
+{
+    morphology_.set_engine(engine);
+    last_params_.reset();
+}
+
+void BackgroundExtractor::set_blur_cache_size(size_t max_bytes)
+{
+    blurred_imgs_cache_.set_max_bytes(max_bytes);
+}
+
+void BackgroundExtractor::set_integral_images(int max_blur_radius, size_t max_bytes)
+{
+    max_blur_radius_ = max_blur_radius;
+    integral_imgs_max_bytes_ = max_bytes;
+}
+
+bool BackgroundExtractor::is_loaded_from_disk_cache() const
+{
+    return loaded_from_disk_cache_;
+}
+
+size_t BackgroundExtractor::get_integral_images_num_bytes() const
+{
+    size_t num_bytes = 0;
+    for (const auto &integral_img : integral_imgs_)
+        num_bytes += integral_img.get_num_bytes();
+    return num_bytes;
+}
+
 const cv::Mat &BackgroundExtractor::get_final_image()
 {
+    if (!session_done_)
+        return preview_img_;
 
+    if (!final_img_composed_)
+    {
+        compose_final_image();
+        final_img_composed_ = true;
+    }
     return final_img_;
 }
 
+void BackgroundExtractor::set_feathering(int feather_radius)
+{
+    feather_radius_ = feather_radius;
+    final_img_composed_ = false;
+}
+
+const cv::Mat_<uint8_t> &BackgroundExtractor::get_min_diff() const
+{
+    return min_diff_;
+}
+
+const cv::Mat_<uint16_t> &BackgroundExtractor::get_best_match_ids() const
+{
+    return best_match_ids_;
+}
+
+int BackgroundExtractor::get_num_images() const
+{
+    return resized_imgs_.size();
+}
+
+cv::Size BackgroundExtractor::get_original_size() const
+{
+    return original_size_;
+}
+
+size_t BackgroundExtractor::estimate_num_bytes(cv::Size original_size, int num_images) const
+{
+    const size_t n = num_images;
+    const cv::Size size(int(resize_factor_ * original_size.width), int(resize_factor_ * original_size.height));
+    const size_t num_pixels = size_t(size.width) * size.height;
+    const size_t num_original_pixels = size_t(original_size.width) * original_size.height;
+
+    // Images, and blurred images at a single radius
+    size_t num_bytes = 2 * n * 3 * num_pixels;
+    if (!streaming_ && size != original_size)
+        num_bytes += n * 3 * num_original_pixels;
+    const size_t integral_imgs_num_bytes = n * IntegralImage::get_num_bytes(size, max_blur_radius_);
+    if (tile_size_ <= 0 && integral_imgs_num_bytes <= integral_imgs_max_bytes_)
+        num_bytes += integral_imgs_num_bytes;
+
+    // Differences, masks, distance maps of the morphology and preview
+    num_bytes += 30 * num_pixels;
+    if (reference_order_ == ReferenceOrder::Coverage)
+        num_bytes += (2 * order_num_bins + n) * num_pixels;
+
+    // Label map, refined reference and compared images, their differences and final image
+    size_t num_label_pixels = num_pixels;
+    if (refine_factor_ > resize_factor_)
+    {
+        num_label_pixels = size_t(refine_factor_ * original_size.width) * size_t(refine_factor_ * original_size.height);
+        num_bytes += 11 * num_label_pixels;
+    }
+    num_bytes += 2 * num_label_pixels + 3 * num_original_pixels;
+    return num_bytes;
+}
+
+void BackgroundExtractor::set_profiling(bool profiling)
+{
+    if (profiling)
+        profiler_.reset();
+    profiler_.set_enabled(profiling);
+}
+
+const Profiler &BackgroundExtractor::get_profiler() const
+{
+    return profiler_;
+}
+
+std::vector<std::pair<std::string, size_t>> BackgroundExtractor::get_buffers_num_bytes() const
+{
+    // Without downsampling, working images share their data with the original ones
+    size_t resized_imgs_num_bytes = 0;
+    for (size_t i = 0; i < resized_imgs_.size(); i++)
+        if (i >= original_imgs_.size() || resized_imgs_[i].data != original_imgs_[i].data)
+            resized_imgs_num_bytes += get_num_bytes(resized_imgs_[i]);
+
+    size_t masks_num_bytes = get_num_bytes(mask_) + get_num_bytes(mask_before_morph_) + get_num_bytes(tmp_mask_) +
+                             get_num_bytes(no_info_mask_) + get_num_bytes(coarse_edges_) +
+                             get_num_bytes(refined_edges_) + get_num_bytes(refined_mask_) +
+                             get_num_bytes(refined_min_diff_);
+    if (label_no_info_mask_.data != no_info_mask_.data)
+        masks_num_bytes += get_num_bytes(label_no_info_mask_);
+
+    size_t final_imgs_num_bytes = get_num_bytes(final_img_);
+    if (preview_img_.data != final_img_.data)
+        final_imgs_num_bytes += get_num_bytes(preview_img_);
+
+    std::vector<std::pair<std::string, size_t>> buffers;
+    buffers.emplace_back("original_imgs", get_num_bytes(original_imgs_) + get_num_bytes(prefetched_img_));
+    buffers.emplace_back("resized_imgs", resized_imgs_num_bytes);
+    buffers.emplace_back("blur_cache", blurred_imgs_cache_.get_num_bytes());
+    buffers.emplace_back("integral_imgs", get_integral_images_num_bytes());
+    buffers.emplace_back("min_diff", get_num_bytes(min_diff_) + get_num_bytes(best_match_ids_) +
+                                         get_num_bytes(speculative_min_diff_) +
+                                         get_num_bytes(speculative_best_match_ids_));
+    buffers.emplace_back("masks", masks_num_bytes);
+    buffers.emplace_back("refined_imgs", get_num_bytes(refined_img_) + get_num_bytes(refined_blurred_ref_));
+    buffers.emplace_back("label_map", get_num_bytes(label_map_));
+    buffers.emplace_back("final_img", final_imgs_num_bytes);
+    buffers.emplace_back("order_histogram", order_histogram_.get_num_bytes());
+    return buffers;
+}
+
+void BackgroundExtractor::write_profile(std::ostream &os) const
+{
+    os << "{\n  \"stages\": ";
+    profiler_.write_json(os);
+    os << ",\n  \"buffers_bytes\": {";
+    const auto buffers = get_buffers_num_bytes();
+    for (size_t i = 0; i < buffers.size(); i++)
+        os << (i > 0 ? "," : "") << "\n    \"" << buffers[i].first << "\": " << buffers[i].second;
+    os << "\n  },\n  \"peak_rss_bytes\": " << Profiler::get_peak_rss_bytes() << "\n}\n";
+}
+
 void BackgroundExtractor::get_overlayed_reference_img(cv::Mat &img)
 {
-    static cv::Mat color_mask;
-    img.create(height_, width_, CV_8UC3);
-    color_mask.create(height_, width_, CV_8UC3);
-    color_mask.setTo(cv::Vec3b(0, 0, 255));
-    assert(valid_mask_);
-    color_mask.setTo(cv::Vec3b(0, 255, 0), mask_);
-    cv::addWeighted(resized_imgs_[crt_id_ref_], 0.7, color_mask, 0.3, 0, img);
+    Profiler::ScopedTimer timer(profiler_, Profiler::Overlay);
 
-    color_mask.setTo(cv::Scalar::all(0));
-    color_mask.setTo(cv::Scalar::all(255), no_info_mask_);
+    // There's no reference image left once the final image has been voted
+    if (voted_)
+    {
+        preview_img_.copyTo(img);
+        return;
+    }
+    assert(valid_mask_);
+    img.create(height_, width_, CV_8UC3);
 
-    cv::addWeighted(img, 0.5, color_mask, 0.5, 0, img);
+    // Blend the reference image with green (selected) or red (rejected), and then with white where the final image
+    // is still missing, in a single pass
+    const OverlayLut &lut = get_overlay_lut();
+    const int num_bands = get_num_bands();
+    thread_pool_->parallel_for(num_bands, [&](int band_id, int) {
+        const cv::Range rows = get_band_rows(band_id, num_bands);
+        for (int y = rows.start; y < rows.end; y++)
+        {
+            const cv::Vec3b *ref_row = resized_imgs_[crt_id_ref_].ptr<cv::Vec3b>(y);
+            const uint8_t *mask_row = mask_[y];
+            const uint8_t *no_info_row = no_info_mask_[y];
+            cv::Vec3b *img_row = img.ptr<cv::Vec3b>(y);
+            for (int x = 0; x < width_; x++)
+            {
+                const int no_info = no_info_row[x] ? 1 : 0;
+                const int selected = mask_row[x] ? 2 : 0;
+                img_row[x][0] = lut.values[no_info][ref_row[x][0]];
+                img_row[x][1] = lut.values[selected + no_info][ref_row[x][1]];
+                img_row[x][2] = lut.values[(2 - selected) + no_info][ref_row[x][2]];
+            }
+        }
+    });
 }
 
 void BackgroundExtractor::reset()
 {
+    async_generation_++;
+    wait_mask_update();
+    wait_prefetch();
+    prefetched_img_.release();
+    prefetched_id_ = -1;
+
+    filenames_.clear();
     original_imgs_.clear();
     resized_imgs_.clear();
-    uchar_blurred_diffs_.clear();
+    blurred_imgs_.clear();
+    blurred_imgs_cache_.clear();
+    integral_imgs_.clear();
+    order_bins_.clear();
+    used_refs_.clear();
 
     crt_id_ref_ = 0;
+    voted_ = false;
     last_params_.reset();
     valid_mask_ = false;
 }
 
-int BackgroundExtractor::img_to_diff_id(int img_id)
+void BackgroundExtractor::get_blurred_img(int img_id, int blur_radius, cv::Mat &blurred_img)
+{
+    if (blurred_imgs_cache_.find(img_id, blur_radius, blurred_img))
+        return;
+
+    // Don't overwrite the data of a cached image. Otherwise, the buffer is reused
+    if (blurred_img.u && blurred_img.u->refcount > 1)
+        blurred_img = cv::Mat();
+    if (integral_imgs_[img_id].can_blur(blur_radius))
+    {
+        integral_imgs_[img_id].box_blur(blur_radius, blurred_img);
+    }
+    else
+    {
+        const cv::Size kernel_blur(2 * blur_radius + 1, 2 * blur_radius + 1);
+        cv::blur(resized_imgs_[img_id], blurred_img, kernel_blur);
+    }
+    blurred_imgs_cache_.insert(img_id, blur_radius, blurred_img);
+}
+
+void BackgroundExtractor::count_blurred_bins(int blur_radius, PixelHistogram &histogram,
+                                             std::vector<cv::Mat_<uint8_t>> *imgs_bins)
+{
+    const int n = resized_imgs_.size();
+    thread_pool_->parallel_for(n, [&](int i, int) { get_blurred_img(i, blur_radius, blurred_imgs_[i]); });
+    if (imgs_bins)
+    {
+        imgs_bins->resize(n);
+        for (auto &bins : *imgs_bins)
+            bins.create(height_, width_);
+    }
+
+    const int num_bands = get_num_bands();
+    thread_pool_->parallel_for(num_bands, [&](int band_id, int) {
+        const cv::Range rows = get_band_rows(band_id, num_bands);
+        cv::Mat_<uint8_t> bins;
+        for (int i = 0; i < n; i++)
+        {
+            if (imgs_bins)
+                bins = (*imgs_bins)[i].rowRange(rows.start, rows.end);
+            histogram.quantize(blurred_imgs_[i].rowRange(rows.start, rows.end), bins);
+            histogram.add(bins, rows);
+        }
+    });
+}
+
+bool BackgroundExtractor::select_next_reference()
+{
+    const int next_ref_id = find_next_reference(-1);
+    if (next_ref_id < 0)
+        return false;
+    crt_id_ref_ = next_ref_id;
+    return true;
+}
+
+int BackgroundExtractor::find_next_reference(int excluded_id)
+{
+    std::vector<int> candidates;
+    for (int i = 0; i < used_refs_.size(); i++)
+        if (!used_refs_[i] && i != excluded_id)
+            candidates.push_back(i);
+    if (candidates.empty())
+        return -1;
+
+    if (reference_order_ == ReferenceOrder::FileOrder || candidates.size() == 1)
+        return candidates.front();
+
+    // Greedy set cover: estimate the mask of each candidate by the pixels whose intensity is shared by at least
+    // another image, and count how many of them haven't been recovered yet
+    const int num_candidates = candidates.size();
+    const int num_bands = get_num_bands();
+    std::vector<std::vector<int>> bands_coverage(num_bands, std::vector<int>(num_candidates, 0));
+    thread_pool_->parallel_for(num_bands, [&](int band_id, int) {
+        const cv::Range rows = get_band_rows(band_id, num_bands);
+        std::vector<int> &coverage = bands_coverage[band_id];
+        for (int y = rows.start; y < rows.end; y++)
+        {
+            const uint8_t *no_info_row = no_info_mask_[y];
+            const uint16_t *counts_row = order_histogram_.get_counts_row(y);
+            for (int x = 0; x < width_; x++)
+            {
+                if (no_info_row[x] == 0)
+                    continue;
+                const uint16_t *counts = counts_row + x * order_num_bins;
+                for (int k = 0; k < num_candidates; k++)
+                    if (order_histogram_.get_votes(counts, order_bins_[candidates[k]](y, x)) >= 2)
+                        coverage[k]++;
+            }
+        }
+    });
+
+    int best_coverage = -1;
+    int best_id = candidates.front();
+    for (int k = 0; k < num_candidates; k++)
+    {
+        int coverage = 0;
+        for (const auto &band_coverage : bands_coverage)
+            coverage += band_coverage[k];
+        if (coverage > best_coverage)
+        {
+            best_coverage = coverage;
+            best_id = candidates[k];
+        }
+    }
+    return best_id;
+}
+
+cv::Mat BackgroundExtractor::get_original_img(int img_id)
+{
+    if (!streaming_)
+    {
+        // Images loaded from the disk cache are decoded the first time they're needed
+        if (original_imgs_[img_id].empty())
+            original_imgs_[img_id] = cv::imread(filenames_[img_id]);
+        return original_imgs_[img_id];
+    }
+
+    wait_prefetch();
+    if (prefetched_id_ == img_id)
+    {
+        prefetched_id_ = -1;
+        cv::Mat original_img = prefetched_img_;
+        prefetched_img_.release();
+        return original_img;
+    }
+    return cv::imread(filenames_[img_id]);
+}
+
+void BackgroundExtractor::prefetch_original_img(int img_id)
+{
+    if (!streaming_ || prefetched_id_ == img_id)
+        return;
+
+    wait_prefetch();
+    prefetched_id_ = img_id;
+    prefetch_done_ = thread_pool_->submit([this, img_id]() { prefetched_img_ = cv::imread(filenames_[img_id]); });
+}
+
+void BackgroundExtractor::wait_prefetch()
+{
+    if (prefetch_done_.valid())
+        prefetch_done_.get();
+}
+
+void BackgroundExtractor::compute_min_diff_tiled(int blur_radius)
+{
+    const cv::Size kernel_blur(2 * blur_radius + 1, 2 * blur_radius + 1);
+    const int num_tiles_x = (width_ + tile_size_ - 1) / tile_size_;
+    const int num_tiles_y = (height_ + tile_size_ - 1) / tile_size_;
+    thread_pool_->parallel_for(num_tiles_x * num_tiles_y, [&](int tile_id, int worker_id) {
+        const cv::Rect tile = get_tile(tile_id, num_tiles_x);
+        auto &buffers = tile_buffers_[worker_id];
+
+        // Filtering a view reads the pixels around it, so that there's no seam between tiles
+        cv::blur(resized_imgs_[crt_id_ref_](tile), buffers.blurred_ref, kernel_blur);
+        cv::Mat_<uint8_t> min_diff = min_diff_(tile);
+        min_diff.setTo(255);
+        buffers.best_match_ids.create(tile.size());
+        for (size_t i = 0; i < resized_imgs_.size(); i++)
+        {
+            if (i == crt_id_ref_)
+                continue;
+            cv::blur(resized_imgs_[i](tile), buffers.blurred_img, kernel_blur);
+            for (int y = 0; y < tile.height; y++)
+                update_min_gray_absdiff(buffers.blurred_ref.ptr<uint8_t>(y), buffers.blurred_img.ptr<uint8_t>(y),
+                                        tile.width, i, min_diff[y], buffers.best_match_ids[y]);
+        }
+    });
+}
+
+void BackgroundExtractor::update_mask_tiled(const ProcessingParams &params)
+{
+    // Pixels of a tile depend on the neighbouring pixels up to the reach of the morphological operations: the
+    // opening kernel radius (plus one for its disk approximation) twice, and 2 pixels per 5x5 erosion
+    const int halo = 2 * (params.open_radius + 1) + 2 * params.num_final_erosions;
+    const cv::Rect img_rect(0, 0, width_, height_);
+    const int num_tiles_x = (width_ + tile_size_ - 1) / tile_size_;
+    const int num_tiles_y = (height_ + tile_size_ - 1) / tile_size_;
+    thread_pool_->parallel_for(num_tiles_x * num_tiles_y, [&](int tile_id, int worker_id) {
+        const cv::Rect tile = get_tile(tile_id, num_tiles_x);
+        const cv::Rect halo_tile = cv::Rect(tile.x - halo, tile.y - halo, tile.width + 2 * halo, tile.height + 2 * halo) & img_rect;
+        auto &buffers = tile_buffers_[worker_id];
+
+        // 1) Threshold
+        cv::threshold(min_diff_(halo_tile), buffers.mask, params.ths, 255, cv::THRESH_BINARY_INV); // 255 if below ths
+
+        // 2) Open and Dilate, then keep the pixels that aren't affected by the border of the halo tile
+        buffers.morphology.set_engine(morphology_.get_engine());
+        buffers.morphology.set_mask(buffers.mask);
+        buffers.morphology.apply(*thread_pool_, params.open_radius, params.num_final_erosions, buffers.mask);
+        buffers.mask(cv::Rect(tile.tl() - halo_tile.tl(), tile.size())).copyTo(mask_(tile));
+    });
+}
+
+cv::Rect BackgroundExtractor::get_tile(int tile_id, int num_tiles_x) const
+{
+    const cv::Rect tile((tile_id % num_tiles_x) * tile_size_, (tile_id / num_tiles_x) * tile_size_, tile_size_, tile_size_);
+    return tile & cv::Rect(0, 0, width_, height_);
+}
+
+int BackgroundExtractor::get_num_bands() const
+{
+    return std::min(height_, 4 * thread_pool_->get_num_threads());
+}
+
+cv::Range BackgroundExtractor::get_band_rows(int band_id, int num_bands) const
 {
-    return (img_id < crt_id_ref_ ? img_id : img_id - 1);
+    return cv::Range(band_id * height_ / num_bands, (band_id + 1) * height_ / num_bands);
 }
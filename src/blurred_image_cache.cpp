@@ -0,0 +1,88 @@
+/*********************************************************************************************************************
+ * File : blurred_image_cache.cpp                                                                                    *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include "blurred_image_cache.h"
+
+namespace
+{
+size_t get_mat_bytes(const cv::Mat &img)
+{
+    return img.total() * img.elemSize();
+}
+} // namespace
+
+BlurredImageCache::BlurredImageCache(size_t max_bytes) : num_bytes_(0),
+                                                         max_bytes_(max_bytes)
+{
+}
+
+void BlurredImageCache::set_max_bytes(size_t max_bytes)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    max_bytes_ = max_bytes;
+    evict();
+}
+
+bool BlurredImageCache::find(int img_id, int blur_radius, cv::Mat &blurred_img)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto it = entries_.find(Key(img_id, blur_radius));
+    if (it == entries_.end())
+        return false;
+
+    // Mark as most recently used
+    lru_keys_.splice(lru_keys_.begin(), lru_keys_, it->second.lru_it);
+    blurred_img = it->second.blurred_img;
+    return true;
+}
+
+void BlurredImageCache::insert(int img_id, int blur_radius, const cv::Mat &blurred_img)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    const Key key(img_id, blur_radius);
+    const auto it = entries_.find(key);
+    if (it != entries_.end())
+    {
+        num_bytes_ -= get_mat_bytes(it->second.blurred_img);
+        lru_keys_.erase(it->second.lru_it);
+        entries_.erase(it);
+    }
+
+    // Don't flush the whole cache for an image that wouldn't fit anyway
+    const size_t num_bytes = get_mat_bytes(blurred_img);
+    if (num_bytes > max_bytes_)
+        return;
+
+    lru_keys_.push_front(key);
+    entries_[key] = Entry{blurred_img, lru_keys_.begin()};
+    num_bytes_ += num_bytes;
+    evict();
+}
+
+void BlurredImageCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+    lru_keys_.clear();
+    num_bytes_ = 0;
+}
+
+size_t BlurredImageCache::get_num_bytes() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return num_bytes_;
+}
+
+void BlurredImageCache::evict()
+{
+    while (num_bytes_ > max_bytes_ && !lru_keys_.empty())
+    {
+        const auto it = entries_.find(lru_keys_.back());
+        num_bytes_ -= get_mat_bytes(it->second.blurred_img);
+        entries_.erase(it);
+        lru_keys_.pop_back();
+    }
+}
@@ -0,0 +1,84 @@
+/*********************************************************************************************************************
+ * File : diff_kernel.cpp                                                                                            *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include <cstdlib>
+#include <opencv2/core/hal/intrin.hpp>
+
+#include "diff_kernel.h"
+
+namespace
+{
+// Fixed-point coefficients used by cv::cvtColor(cv::COLOR_BGR2GRAY) on 8-bit images
+const int gray_shift = 15;
+const int b2y = 3735;
+const int g2y = 19235;
+const int r2y = 9798;
+
+inline uint8_t bgr_to_gray(int b, int g, int r)
+{
+    return uint8_t((b * b2y + g * g2y + r * r2y + (1 << (gray_shift - 1))) >> gray_shift);
+}
+
+#if CV_SIMD
+inline cv::v_uint16 bgr_to_gray(const cv::v_uint16 &b, const cv::v_uint16 &g, const cv::v_uint16 &r)
+{
+    cv::v_uint32 b_lo, b_hi, g_lo, g_hi, r_lo, r_hi;
+    cv::v_mul_expand(b, cv::vx_setall_u16(b2y), b_lo, b_hi);
+    cv::v_mul_expand(g, cv::vx_setall_u16(g2y), g_lo, g_hi);
+    cv::v_mul_expand(r, cv::vx_setall_u16(r2y), r_lo, r_hi);
+
+    const cv::v_uint32 round = cv::vx_setall_u32(1 << (gray_shift - 1));
+    return cv::v_pack((b_lo + g_lo + r_lo + round) >> gray_shift,
+                      (b_hi + g_hi + r_hi + round) >> gray_shift);
+}
+#endif
+} // namespace
+
+void update_min_gray_absdiff(const uint8_t *ref_row, const uint8_t *img_row, int width, uint16_t img_id,
+                             uint8_t *min_diff_row, uint16_t *best_match_row)
+{
+    int x = 0;
+#if CV_SIMD
+    const int num_lanes = CV_SIMD_WIDTH;
+    const cv::v_uint16 v_img_id = cv::vx_setall_u16(img_id);
+    for (; x <= width - num_lanes; x += num_lanes)
+    {
+        cv::v_uint8 ref_b, ref_g, ref_r, img_b, img_g, img_r;
+        cv::v_load_deinterleave(ref_row + 3 * x, ref_b, ref_g, ref_r);
+        cv::v_load_deinterleave(img_row + 3 * x, img_b, img_g, img_r);
+
+        // Absolute difference, widened to 16 bits
+        cv::v_uint16 b_lo, b_hi, g_lo, g_hi, r_lo, r_hi;
+        cv::v_expand(cv::v_absdiff(ref_b, img_b), b_lo, b_hi);
+        cv::v_expand(cv::v_absdiff(ref_g, img_g), g_lo, g_hi);
+        cv::v_expand(cv::v_absdiff(ref_r, img_r), r_lo, r_hi);
+
+        const cv::v_uint16 gray_lo = bgr_to_gray(b_lo, g_lo, r_lo);
+        const cv::v_uint16 gray_hi = bgr_to_gray(b_hi, g_hi, r_hi);
+
+        // Keep the minimum, along with the ID of the image where it has been reached
+        cv::v_uint16 min_lo, min_hi;
+        cv::v_expand(cv::vx_load(min_diff_row + x), min_lo, min_hi);
+        const cv::v_uint16 best_lo = cv::vx_load(best_match_row + x);
+        const cv::v_uint16 best_hi = cv::vx_load(best_match_row + x + num_lanes / 2);
+        cv::v_store(best_match_row + x, cv::v_select(gray_lo < min_lo, v_img_id, best_lo));
+        cv::v_store(best_match_row + x + num_lanes / 2, cv::v_select(gray_hi < min_hi, v_img_id, best_hi));
+        cv::v_store(min_diff_row + x, cv::v_pack(cv::v_min(gray_lo, min_lo), cv::v_min(gray_hi, min_hi)));
+    }
+#endif
+
+    for (; x < width; x++)
+    {
+        const uint8_t gray = bgr_to_gray(std::abs(ref_row[3 * x] - img_row[3 * x]),
+                                         std::abs(ref_row[3 * x + 1] - img_row[3 * x + 1]),
+                                         std::abs(ref_row[3 * x + 2] - img_row[3 * x + 2]));
+        if (gray < min_diff_row[x])
+        {
+            min_diff_row[x] = gray;
+            best_match_row[x] = img_id;
+        }
+    }
+}
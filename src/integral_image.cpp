@@ -0,0 +1,94 @@
+/*********************************************************************************************************************
+ * File : integral_image.cpp                                                                                         *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include <assert.h>
+#include <opencv2/core.hpp>
+
+#include "integral_image.h"
+
+IntegralImage::IntegralImage() : max_radius_(-1)
+{
+}
+
+size_t IntegralImage::get_num_bytes(cv::Size size, int max_radius)
+{
+    return size_t(size.height + 2 * max_radius + 1) * (size.width + 2 * max_radius + 1) * 3 * sizeof(uint32_t);
+}
+
+void IntegralImage::compute(const cv::Mat &img, int max_radius)
+{
+    assert(img.type() == CV_8UC3);
+    size_ = img.size();
+    max_radius_ = max_radius;
+
+    cv::Mat padded_img;
+    cv::copyMakeBorder(img, padded_img, max_radius, max_radius, max_radius, max_radius, cv::BORDER_REFLECT_101);
+
+    // First row and first column are zeros
+    sums_.create(padded_img.rows + 1, padded_img.cols + 1, CV_32SC3);
+    sums_.row(0).setTo(0);
+
+    const int num_values = 3 * padded_img.cols;
+    for (int y = 0; y < padded_img.rows; y++)
+    {
+        const uint8_t *img_row = padded_img.ptr<uint8_t>(y);
+        const uint32_t *prev_sums_row = sums_.ptr<uint32_t>(y) + 3;
+        uint32_t *sums_row = sums_.ptr<uint32_t>(y + 1);
+        sums_row[0] = sums_row[1] = sums_row[2] = 0;
+        sums_row += 3;
+
+        uint32_t row_sums[3] = {0, 0, 0};
+        for (int k = 0; k < num_values; k += 3)
+        {
+            for (int c = 0; c < 3; c++)
+            {
+                row_sums[c] += img_row[k + c];
+                sums_row[k + c] = prev_sums_row[k + c] + row_sums[c];
+            }
+        }
+    }
+}
+
+void IntegralImage::release()
+{
+    sums_.release();
+    max_radius_ = -1;
+}
+
+void IntegralImage::box_blur(int blur_radius, cv::Mat &blurred_img) const
+{
+    assert(can_blur(blur_radius));
+    blurred_img.create(size_, CV_8UC3);
+
+    // Sum over rows [y - r, y + r] and columns [x - r, x + r] of the image, shifted by the padding
+    const int kernel_size = 2 * blur_radius + 1;
+    const int offset = max_radius_ - blur_radius;
+    const double inv_area = 1. / (kernel_size * kernel_size);
+    const int num_values = 3 * size_.width;
+    for (int y = 0; y < size_.height; y++)
+    {
+        const uint32_t *top_row = sums_.ptr<uint32_t>(y + offset) + 3 * offset;
+        const uint32_t *bottom_row = sums_.ptr<uint32_t>(y + offset + kernel_size) + 3 * offset;
+        const int right = 3 * kernel_size;
+        uint8_t *blurred_row = blurred_img.ptr<uint8_t>(y);
+        for (int k = 0; k < num_values; k++)
+        {
+            // Unsigned arithmetic wraps around, which cancels the overflow of the table
+            const uint32_t sum = bottom_row[k + right] - bottom_row[k] - top_row[k + right] + top_row[k];
+            blurred_row[k] = uint8_t(sum * inv_area + 0.5);
+        }
+    }
+}
+
+bool IntegralImage::can_blur(int blur_radius) const
+{
+    return !sums_.empty() && blur_radius >= 0 && blur_radius <= max_radius_;
+}
+
+size_t IntegralImage::get_num_bytes() const
+{
+    return sums_.total() * sums_.elemSize();
+}
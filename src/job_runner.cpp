@@ -0,0 +1,160 @@
+/*********************************************************************************************************************
+ * File : job_runner.cpp                                                                                             *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include <algorithm>
+#include <chrono>
+#include <opencv2/imgcodecs.hpp>
+#include <boost/filesystem.hpp>
+#include <thread>
+
+#include "job_runner.h"
+
+namespace bfs = boost::filesystem;
+
+JobRunner::Job::Job(const std::string &images_dir_path,
+                    const std::string &images_extension,
+                    const BackgroundExtractor::ProcessingParams &params) : images_dir_path(images_dir_path),
+                                                                           images_extension(images_extension),
+                                                                           params(params),
+                                                                           vote(false) {}
+
+JobRunner::JobRunner(float resize_factor,
+                     int num_threads,
+                     int max_concurrent_jobs,
+                     size_t max_bytes) : resize_factor_(resize_factor),
+                                         max_concurrent_jobs_(std::max(1, max_concurrent_jobs)),
+                                         thread_pool_(std::make_shared<ThreadPool>(num_threads)),
+                                         next_job_id_(0),
+                                         max_bytes_(max_bytes),
+                                         num_reserved_bytes_(0),
+                                         num_running_jobs_(0)
+{
+}
+
+void JobRunner::add_job(const Job &job)
+{
+    jobs_.push_back(job);
+}
+
+void JobRunner::set_setup_callback(const SetupCb &setup_cb)
+{
+    setup_cb_ = setup_cb;
+}
+
+void JobRunner::set_done_callback(const DoneCb &done_cb)
+{
+    done_cb_ = done_cb;
+}
+
+std::vector<JobRunner::Result> JobRunner::run()
+{
+    results_.assign(jobs_.size(), Result());
+    next_job_id_ = 0;
+
+    // Jobs are run by threads of their own, since they spend time waiting for the memory budget and for their
+    // parallel loops. The actual work happens in the shared pool
+    const int num_runners = std::min<int>(max_concurrent_jobs_, jobs_.size());
+    std::vector<std::thread> runners;
+    runners.reserve(num_runners);
+    for (int i = 0; i < num_runners; i++)
+        runners.emplace_back(&JobRunner::run_jobs, this);
+    for (auto &runner : runners)
+        runner.join();
+
+    jobs_.clear();
+    std::vector<Result> results;
+    results.swap(results_);
+    return results;
+}
+
+void JobRunner::run_jobs()
+{
+    while (true)
+    {
+        size_t job_id;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (next_job_id_ >= jobs_.size())
+                return;
+            job_id = next_job_id_++;
+        }
+        results_[job_id] = run_job(jobs_[job_id]);
+    }
+}
+
+JobRunner::Result JobRunner::run_job(const Job &job)
+{
+    Result result;
+    BackgroundExtractor extractor(resize_factor_, thread_pool_);
+    if (setup_cb_)
+        setup_cb_(job, extractor);
+
+    const size_t num_bytes = estimate_num_bytes(job, extractor);
+    acquire_memory(num_bytes);
+
+    const auto start_time = std::chrono::steady_clock::now();
+    result.loaded = extractor.load_images(job.images_dir_path, job.images_extension);
+    if (result.loaded)
+    {
+        result.num_images = extractor.get_num_images();
+        if (job.vote)
+        {
+            result.status = extractor.vote_final_image(job.params.blur_radius);
+        }
+        else
+        {
+            result.status = BackgroundExtractor::Status::Continue;
+            while (result.status == BackgroundExtractor::Status::Continue)
+            {
+                extractor.update_mask(job.params);
+                result.status = extractor.finalize_mask();
+                result.num_passes++;
+            }
+        }
+
+        // Compose the final image while the memory is still reserved
+        extractor.get_final_image();
+    }
+    result.elapsed_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+
+    if (done_cb_)
+        done_cb_(job, extractor, result);
+    release_memory(num_bytes);
+    return result;
+}
+
+size_t JobRunner::estimate_num_bytes(const Job &job, const BackgroundExtractor &extractor) const
+{
+    std::vector<cv::String> filenames;
+    cv::glob((bfs::path(job.images_dir_path) / ("*." + job.images_extension)).string(), filenames);
+    if (filenames.empty())
+        return 0;
+
+    // The JPEG decoder only decodes an eighth of the first image. The size is rounded up, which is fine for an
+    // estimate
+    const cv::Mat reduced_img = cv::imread(filenames[0], cv::IMREAD_REDUCED_GRAYSCALE_8);
+    if (reduced_img.empty())
+        return 0;
+    return extractor.estimate_num_bytes(cv::Size(8 * reduced_img.cols, 8 * reduced_img.rows), filenames.size());
+}
+
+void JobRunner::acquire_memory(size_t num_bytes)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    memory_cv_.wait(lock, [&]() { return num_running_jobs_ == 0 || num_reserved_bytes_ + num_bytes <= max_bytes_; });
+    num_reserved_bytes_ += num_bytes;
+    num_running_jobs_++;
+}
+
+void JobRunner::release_memory(size_t num_bytes)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        num_reserved_bytes_ -= num_bytes;
+        num_running_jobs_--;
+    }
+    memory_cv_.notify_all();
+}
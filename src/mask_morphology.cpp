@@ -0,0 +1,351 @@
+/*********************************************************************************************************************
+ * File : mask_morphology.cpp                                                                                        *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include <algorithm>
+#include <limits>
+#include <opencv2/imgproc.hpp>
+
+#include "mask_morphology.h"
+
+namespace
+{
+/// Distance used for pixels that can't reach any target pixel
+const float far_dist = 1e20f;
+
+/// Number of erosion steps of the pixels that are never removed
+const uint16_t never_removed = std::numeric_limits<uint16_t>::max();
+
+/// @brief Sets the mask to 255 where the map is greater than a threshold, or lower or equal if inverted, and to 0
+/// elsewhere
+/// @note Unlike cv::compare, it doesn't allocate any memory once dst has the right size
+template <typename T, typename Ths>
+void threshold_map(ThreadPool &pool, const cv::Mat_<T> &map, Ths ths, bool inverted, cv::Mat_<uint8_t> &dst)
+{
+    dst.create(map.rows, map.cols);
+    const int num_bands = std::max(1, std::min(map.rows, 4 * pool.get_num_threads()));
+    pool.parallel_for(num_bands, [&](int band_id, int) {
+        for (int y = band_id * map.rows / num_bands; y < (band_id + 1) * map.rows / num_bands; y++)
+        {
+            const T *map_row = map[y];
+            uint8_t *dst_row = dst[y];
+            for (int x = 0; x < map.cols; x++)
+                dst_row[x] = (map_row[x] > ths) != inverted ? 255 : 0;
+        }
+    });
+}
+} // namespace
+
+MaskMorphology::MaskMorphology() : engine_(DistanceMap),
+                                   cached_open_radius_(-1),
+                                   valid_sq_dist_to_bg_(false),
+                                   valid_erosion_steps_(false)
+{
+    // cv::erode uses the centered anchor, whatever the anchor given to cv::getStructuringElement. A 5x5 erosion
+    // removes a pixel if there's a background pixel at one of the kernel offsets
+    erosion_kernel_ = cv::getStructuringElement(cv::MORPH_ELLIPSE, cv::Size(5, 5));
+    for (int i = 0; i < erosion_kernel_.rows; i++)
+        for (int j = 0; j < erosion_kernel_.cols; j++)
+            if (erosion_kernel_.at<uint8_t>(i, j))
+                erosion_offsets_.emplace_back(j - 2, i - 2);
+}
+
+void MaskMorphology::reserve(cv::Size size, int num_workers)
+{
+    mask_.create(size);
+    opened_mask_.create(size);
+    if (engine_ == Kernel)
+        return;
+    sq_dist_to_bg_.create(size);
+    sq_dist_.create(size);
+    erosion_steps_.create(size);
+    bfs_queue_.resize(size_t(size.width) * size.height);
+    tmp_envelopes_.resize(num_workers);
+    tmp_parabolas_.resize(num_workers);
+    for (int i = 0; i < num_workers; i++)
+    {
+        tmp_envelopes_[i].resize(2 * size.width + 1);
+        tmp_parabolas_[i].resize(size.width);
+    }
+}
+
+void MaskMorphology::set_engine(Engine engine)
+{
+    engine_ = engine;
+    cached_open_radius_ = -1;
+    valid_sq_dist_to_bg_ = false;
+    valid_erosion_steps_ = false;
+}
+
+MaskMorphology::Engine MaskMorphology::get_engine() const
+{
+    return engine_;
+}
+
+void MaskMorphology::set_mask(const cv::Mat_<uint8_t> &mask)
+{
+    mask.copyTo(mask_);
+    cached_open_radius_ = -1;
+    valid_sq_dist_to_bg_ = false;
+    valid_erosion_steps_ = false;
+}
+
+void MaskMorphology::apply(ThreadPool &pool, int open_radius, int num_final_erosions, cv::Mat_<uint8_t> &dst)
+{
+    if (engine_ == Kernel)
+        apply_kernels(open_radius, num_final_erosions, dst);
+    else
+        apply_distance_maps(pool, open_radius, num_final_erosions, dst);
+}
+
+void MaskMorphology::apply_kernels(int open_radius, int num_final_erosions, cv::Mat_<uint8_t> &dst)
+{
+    // Alternate between dst and opened_mask_, since in-place filters copy their input
+    mask_.copyTo(dst);
+
+    // Opening (to remove small areas)
+    if (open_radius > 0)
+    {
+        const cv::Mat &opening_kernel = get_opening_kernel(open_radius);
+        cv::erode(dst, opened_mask_, opening_kernel);
+        cv::dilate(opened_mask_, dst, opening_kernel);
+    }
+
+    // Erosion (make areas grow)
+    for (int i = 0; i < num_final_erosions; i++)
+    {
+        cv::erode(dst, opened_mask_, erosion_kernel_);
+        cv::swap(dst, opened_mask_);
+    }
+}
+
+void MaskMorphology::apply_distance_maps(ThreadPool &pool, int open_radius, int num_final_erosions,
+                                         cv::Mat_<uint8_t> &dst)
+{
+    // Opening (to remove small areas)
+    if (open_radius != cached_open_radius_)
+    {
+        if (open_radius > 0)
+        {
+            if (!valid_sq_dist_to_bg_)
+            {
+                compute_sq_dist(pool, mask_, 0, sq_dist_to_bg_);
+                valid_sq_dist_to_bg_ = true;
+            }
+
+            // Erosion keeps pixels far enough from the background, and dilation adds pixels close enough to them
+            const float sq_radius = get_disk_sq_radius(open_radius);
+            threshold_map(pool, sq_dist_to_bg_, sq_radius, false, opened_mask_);
+            compute_sq_dist(pool, opened_mask_, 255, sq_dist_);
+            threshold_map(pool, sq_dist_, sq_radius, true, opened_mask_);
+        }
+        else
+        {
+            mask_.copyTo(opened_mask_);
+        }
+        cached_open_radius_ = open_radius;
+        valid_erosion_steps_ = false;
+    }
+
+    // Erosion (make areas grow)
+    if (num_final_erosions <= 0)
+    {
+        opened_mask_.copyTo(dst);
+        return;
+    }
+    if (!valid_erosion_steps_)
+    {
+        compute_erosion_steps(opened_mask_, erosion_steps_);
+        valid_erosion_steps_ = true;
+    }
+    threshold_map(pool, erosion_steps_, num_final_erosions, false, dst);
+}
+
+void MaskMorphology::compute_sq_dist(ThreadPool &pool, const cv::Mat_<uint8_t> &mask, uint8_t target,
+                                     cv::Mat_<float> &sq_dist)
+{
+    const int width = mask.cols;
+    const int height = mask.rows;
+    sq_dist.create(height, width);
+
+    // 1) Vertical distance to the nearest target pixel of each column, computed on strips of columns
+    const int num_strips = std::min(width, 4 * pool.get_num_threads());
+    pool.parallel_for(num_strips, [&](int strip_id, int) {
+        const int x_begin = strip_id * width / num_strips;
+        const int x_end = (strip_id + 1) * width / num_strips;
+        for (int y = 0; y < height; y++)
+        {
+            const uint8_t *mask_row = mask[y];
+            const float *prev_row = y > 0 ? sq_dist[y - 1] : nullptr;
+            float *row = sq_dist[y];
+            for (int x = x_begin; x < x_end; x++)
+            {
+                if (mask_row[x] == target)
+                    row[x] = 0.f;
+                else
+                    row[x] = (prev_row && prev_row[x] < far_dist) ? prev_row[x] + 1.f : far_dist;
+            }
+        }
+        for (int y = height - 2; y >= 0; y--)
+        {
+            const float *next_row = sq_dist[y + 1];
+            float *row = sq_dist[y];
+            for (int x = x_begin; x < x_end; x++)
+                row[x] = std::min(row[x], next_row[x] + 1.f);
+        }
+    });
+
+    // 2) Lower envelope of the parabolas centered on each pixel of the row (Felzenszwalb and Huttenlocher)
+    const int num_workers = pool.get_num_threads();
+    tmp_envelopes_.resize(num_workers);
+    tmp_parabolas_.resize(num_workers);
+    pool.parallel_for(height, [&](int y, int worker_id) {
+        auto &envelope = tmp_envelopes_[worker_id];
+        auto &parabolas = tmp_parabolas_[worker_id];
+        envelope.resize(2 * width + 1);
+        parabolas.resize(width);
+        float *f = envelope.data();           // Squared vertical distances
+        float *z = envelope.data() + width; // Boundaries between parabolas
+        int *v = parabolas.data();           // Centers of the parabolas of the envelope
+
+        float *row = sq_dist[y];
+        for (int x = 0; x < width; x++)
+            f[x] = row[x] < far_dist ? row[x] * row[x] : far_dist;
+
+        // Columns without any target pixel don't contribute to the envelope
+        int k = -1;
+        for (int q = 0; q < width; q++)
+        {
+            if (f[q] >= far_dist)
+                continue;
+            if (k < 0)
+            {
+                k = 0;
+                v[0] = q;
+                z[0] = -far_dist;
+                z[1] = far_dist;
+                continue;
+            }
+            float s = ((f[q] + float(q) * q) - (f[v[k]] + float(v[k]) * v[k])) / (2.f * (q - v[k]));
+            while (s <= z[k])
+            {
+                k--;
+                s = ((f[q] + float(q) * q) - (f[v[k]] + float(v[k]) * v[k])) / (2.f * (q - v[k]));
+            }
+            k++;
+            v[k] = q;
+            z[k] = s;
+            z[k + 1] = far_dist;
+        }
+
+        if (k < 0)
+        {
+            std::fill(row, row + width, far_dist);
+            return;
+        }
+        k = 0;
+        for (int q = 0; q < width; q++)
+        {
+            while (z[k + 1] < q)
+                k++;
+            row[q] = float(q - v[k]) * (q - v[k]) + f[v[k]];
+        }
+    });
+}
+
+void MaskMorphology::compute_erosion_steps(const cv::Mat_<uint8_t> &mask, cv::Mat_<uint16_t> &steps)
+{
+    const int width = mask.cols;
+    const int height = mask.rows;
+    steps.create(height, width);
+    bfs_queue_.resize(size_t(width) * height);
+
+    // Background pixels are removed from the start
+    size_t queue_end = 0;
+    for (int y = 0; y < height; y++)
+    {
+        const uint8_t *mask_row = mask[y];
+        uint16_t *steps_row = steps[y];
+        for (int x = 0; x < width; x++)
+        {
+            if (mask_row[x] == 0)
+            {
+                steps_row[x] = 0;
+                bfs_queue_[queue_end++] = y * width + x;
+            }
+            else
+            {
+                steps_row[x] = never_removed;
+            }
+        }
+    }
+
+    // Breadth-first search: each erosion removes the pixels having a removed pixel at one of the kernel offsets.
+    // Offsets leading outside the image are skipped, since cv::erode pads the image with foreground pixels
+    for (size_t queue_begin = 0; queue_begin < queue_end; queue_begin++)
+    {
+        const int y = bfs_queue_[queue_begin] / width;
+        const int x = bfs_queue_[queue_begin] - y * width;
+        const uint16_t next_step = std::min<int>(steps(y, x) + 1, never_removed - 1);
+        for (const auto &offset : erosion_offsets_)
+        {
+            const int next_x = x + offset.x;
+            const int next_y = y + offset.y;
+            if (next_x < 0 || next_x >= width || next_y < 0 || next_y >= height)
+                continue;
+            uint16_t &next_steps = steps(next_y, next_x);
+            if (next_steps == never_removed)
+            {
+                next_steps = next_step;
+                bfs_queue_[queue_end++] = next_y * width + next_x;
+            }
+        }
+    }
+}
+
+int MaskMorphology::get_disk_sq_radius(int radius)
+{
+    if (radius >= int(disk_sq_radii_.size()))
+        disk_sq_radii_.resize(radius + 1, -1);
+    if (disk_sq_radii_[radius] >= 0)
+        return disk_sq_radii_[radius];
+
+    // Pick the squared radius minimizing the number of kernel offsets that don't match the disk
+    const cv::Mat &kernel = get_opening_kernel(radius);
+    int best_sq_radius = 0;
+    int best_num_mismatches = std::numeric_limits<int>::max();
+    for (int sq_radius = (radius - 1) * (radius - 1); sq_radius <= (radius + 1) * (radius + 1); sq_radius++)
+    {
+        int num_mismatches = 0;
+        for (int i = 0; i < kernel.rows; i++)
+        {
+            for (int j = 0; j < kernel.cols; j++)
+            {
+                const bool in_disk = (i - radius) * (i - radius) + (j - radius) * (j - radius) <= sq_radius;
+                if (in_disk != (kernel.at<uint8_t>(i, j) != 0))
+                    num_mismatches++;
+            }
+        }
+        if (num_mismatches < best_num_mismatches)
+        {
+            best_num_mismatches = num_mismatches;
+            best_sq_radius = sq_radius;
+        }
+    }
+
+    disk_sq_radii_[radius] = best_sq_radius;
+    return best_sq_radius;
+}
+
+const cv::Mat &MaskMorphology::get_opening_kernel(int radius)
+{
+    if (radius >= int(opening_kernels_.size()))
+        opening_kernels_.resize(radius + 1);
+    if (opening_kernels_[radius].empty())
+        opening_kernels_[radius] = cv::getStructuringElement(cv::MORPH_ELLIPSE,
+                                                             cv::Size(2 * radius + 1, 2 * radius + 1),
+                                                             cv::Point(radius, radius));
+    return opening_kernels_[radius];
+}
@@ -0,0 +1,79 @@
+/*********************************************************************************************************************
+ * File : pixel_histogram.cpp                                                                                        *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include <assert.h>
+#include <limits>
+#include <opencv2/imgproc.hpp>
+
+#include "pixel_histogram.h"
+
+PixelHistogram::PixelHistogram() : num_bins_(0)
+{
+}
+
+void PixelHistogram::create(cv::Size size, int num_bins)
+{
+    assert(num_bins >= 2 && num_bins <= 256);
+    num_bins_ = num_bins;
+    counts_.create(size.height, size.width * num_bins);
+    counts_.setTo(0);
+}
+
+int PixelHistogram::get_num_bins() const
+{
+    return num_bins_;
+}
+
+void PixelHistogram::quantize(const cv::Mat &bgr_img, cv::Mat_<uint8_t> &bins) const
+{
+    cv::cvtColor(bgr_img, bins, cv::COLOR_BGR2GRAY);
+    for (int y = 0; y < bins.rows; y++)
+    {
+        uint8_t *bins_row = bins[y];
+        for (int x = 0; x < bins.cols; x++)
+            bins_row[x] = (bins_row[x] * num_bins_) >> 8;
+    }
+}
+
+void PixelHistogram::add(const cv::Mat_<uint8_t> &bins, const cv::Range &rows)
+{
+    for (int y = rows.start; y < rows.end; y++)
+    {
+        const uint8_t *bins_row = bins[y - rows.start];
+        uint16_t *counts_row = counts_[y];
+        for (int x = 0; x < bins.cols; x++)
+        {
+            uint16_t &count = counts_row[x * num_bins_ + bins_row[x]];
+            if (count < std::numeric_limits<uint16_t>::max())
+                count++;
+        }
+    }
+}
+
+void PixelHistogram::remove(const cv::Mat_<uint8_t> &bins, const cv::Range &rows)
+{
+    for (int y = rows.start; y < rows.end; y++)
+    {
+        const uint8_t *bins_row = bins[y - rows.start];
+        uint16_t *counts_row = counts_[y];
+        for (int x = 0; x < bins.cols; x++)
+        {
+            uint16_t &count = counts_row[x * num_bins_ + bins_row[x]];
+            assert(count > 0);
+            count--;
+        }
+    }
+}
+
+const uint16_t *PixelHistogram::get_counts_row(int y) const
+{
+    return counts_[y];
+}
+
+size_t PixelHistogram::get_num_bytes() const
+{
+    return counts_.total() * counts_.elemSize();
+}
@@ -0,0 +1,118 @@
+/*********************************************************************************************************************
+ * File : profiler.cpp                                                                                               *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include <algorithm>
+#include <sys/resource.h>
+
+#include "profiler.h"
+
+Profiler::ScopedTimer::ScopedTimer(Profiler &profiler, Stage stage) : profiler_(profiler.is_enabled() ? &profiler : nullptr),
+                                                                      stage_(stage)
+{
+    if (profiler_)
+        start_ = std::chrono::steady_clock::now();
+}
+
+Profiler::ScopedTimer::~ScopedTimer()
+{
+    if (profiler_)
+        profiler_->add_time(stage_, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_).count());
+}
+
+Profiler::Profiler() : enabled_(false)
+{
+}
+
+void Profiler::set_enabled(bool enabled)
+{
+    enabled_ = enabled;
+}
+
+bool Profiler::is_enabled() const
+{
+    return enabled_.load(std::memory_order_relaxed);
+}
+
+void Profiler::reset()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::fill(stats_, stats_ + NumStages, StageStats());
+}
+
+void Profiler::add_time(Stage stage, double elapsed_ms)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    StageStats &stats = stats_[stage];
+    stats.count++;
+    stats.total_ms += elapsed_ms;
+    stats.max_ms = std::max(stats.max_ms, elapsed_ms);
+}
+
+void Profiler::add_skip(Stage stage)
+{
+    if (!is_enabled())
+        return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_[stage].num_skips++;
+}
+
+int Profiler::get_count(Stage stage) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_[stage].count;
+}
+
+int Profiler::get_num_skips(Stage stage) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_[stage].num_skips;
+}
+
+double Profiler::get_total_ms(Stage stage) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_[stage].total_ms;
+}
+
+double Profiler::get_max_ms(Stage stage) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_[stage].max_ms;
+}
+
+const char *Profiler::get_stage_name(Stage stage)
+{
+    static const char *const names[NumStages] = {"load", "decode", "blur", "diff", "speculative_diff", "threshold",
+                                                 "morphology", "tiled_diff", "tiled_update", "overlay", "finalize",
+                                                 "refine", "compose", "vote"};
+    return names[stage];
+}
+
+size_t Profiler::get_peak_rss_bytes()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    return size_t(usage.ru_maxrss) * 1024; // Kilobytes on Linux
+}
+
+void Profiler::write_json(std::ostream &os) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    os << "{";
+    bool first = true;
+    for (int stage = 0; stage < NumStages; stage++)
+    {
+        const StageStats &stats = stats_[stage];
+        if (stats.count == 0 && stats.num_skips == 0)
+            continue;
+        os << (first ? "" : ",") << "\n    \"" << get_stage_name(Stage(stage)) << "\": {\"count\": " << stats.count
+           << ", \"skipped\": " << stats.num_skips << ", \"total_ms\": " << stats.total_ms
+           << ", \"max_ms\": " << stats.max_ms << "}";
+        first = false;
+    }
+    os << "\n  }";
+}
@@ -0,0 +1,155 @@
+/*********************************************************************************************************************
+ * File : streaming_background_extractor.cpp                                                                         *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include <assert.h>
+#include <iostream>
+#include <limits>
+#include <opencv2/imgproc.hpp>
+
+#include "streaming_background_extractor.h"
+
+StreamingBackgroundExtractor::StreamingBackgroundExtractor(int window_size, int output_period, float resize_factor,
+                                                           int blur_radius, int num_bins)
+    : num_frames_(0), window_size_(window_size), output_period_(output_period), resize_factor_(resize_factor),
+      blur_radius_(blur_radius), num_bins_(num_bins)
+{
+    assert(window_size_ >= 2 && window_size_ <= std::numeric_limits<uint16_t>::max());
+    assert(output_period_ >= 1);
+    set_num_threads(0);
+}
+
+bool StreamingBackgroundExtractor::open(const std::string &source)
+{
+    num_frames_ = 0;
+    if (!capture_.open(source))
+    {
+        std::cerr << "Unable to open the video stream: " << source << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool StreamingBackgroundExtractor::read_next_frame(bool &new_background)
+{
+    new_background = false;
+    if (!capture_.read(frame_) || frame_.empty())
+        return false;
+    new_background = push_frame(frame_);
+    return true;
+}
+
+bool StreamingBackgroundExtractor::push_frame(const cv::Mat &frame)
+{
+    assert(frame.type() == CV_8UC3);
+    if (num_frames_ == 0 || frame.size() != frame_size_)
+    {
+        if (num_frames_ != 0)
+            std::cerr << "The frame size has changed. Restart the sliding window" << std::endl;
+        reset(frame.size());
+    }
+
+    if (resize_factor_ != 1.f)
+        cv::resize(frame, resized_frame_, working_size_, 0, 0, cv::INTER_AREA);
+    else
+        resized_frame_ = frame;
+    cv::blur(resized_frame_, blurred_frame_, cv::Size(2 * blur_radius_ + 1, 2 * blur_radius_ + 1));
+
+    // The oldest frame of the window is replaced by the new one
+    cv::Mat_<uint8_t> &bins = window_bins_[num_frames_ % window_size_];
+    const bool window_full = num_frames_ >= window_size_;
+    const bool first_frame = num_frames_ == 0;
+
+    const int num_bands = std::min(working_size_.height, 4 * thread_pool_->get_num_threads());
+    thread_pool_->parallel_for(num_bands, [&](int band_id, int) {
+        const cv::Range rows = get_band_rows(band_id, num_bands);
+        cv::Mat_<uint8_t> band_bins = bins.rowRange(rows.start, rows.end);
+        if (window_full)
+            histogram_.remove(band_bins, rows);
+        histogram_.quantize(blurred_frame_.rowRange(rows.start, rows.end), band_bins);
+        histogram_.add(band_bins, rows);
+
+        // Only pixels whose bin changes in the histogram need to be compared, but comparing all of them keeps the
+        // loop branch-light, and it's still O(1) per pixel
+        for (int y = rows.start; y < rows.end; y++)
+        {
+            const uint16_t *counts_row = histogram_.get_counts_row(y);
+            const uint8_t *bins_row = bins[y];
+            const cv::Vec3b *frame_row = resized_frame_.ptr<cv::Vec3b>(y);
+            uint8_t *bg_bins_row = crt_background_bins_[y];
+            cv::Vec3b *bg_row = crt_background_.ptr<cv::Vec3b>(y);
+            for (int x = 0; x < working_size_.width; x++)
+            {
+                const uint16_t *counts = counts_row + x * num_bins_;
+                if (first_frame ||
+                    histogram_.get_votes(counts, bins_row[x]) >= histogram_.get_votes(counts, bg_bins_row[x]))
+                {
+                    bg_bins_row[x] = bins_row[x];
+                    bg_row[x] = frame_row[x];
+                }
+            }
+        }
+    });
+    num_frames_++;
+
+    if (num_frames_ % output_period_ != 0)
+        return false;
+
+    crt_background_.copyTo(background_);
+    thread_pool_->parallel_for(num_bands, [&](int band_id, int) {
+        const cv::Range rows = get_band_rows(band_id, num_bands);
+        for (int y = rows.start; y < rows.end; y++)
+        {
+            const uint16_t *counts_row = histogram_.get_counts_row(y);
+            const uint8_t *bg_bins_row = crt_background_bins_[y];
+            uint8_t *mask_row = confidence_mask_[y];
+            for (int x = 0; x < working_size_.width; x++)
+                mask_row[x] = histogram_.get_votes(counts_row + x * num_bins_, bg_bins_row[x]) >= 2 ? 255 : 0;
+        }
+    });
+    return true;
+}
+
+const cv::Mat &StreamingBackgroundExtractor::get_background() const
+{
+    return background_;
+}
+
+const cv::Mat_<uint8_t> &StreamingBackgroundExtractor::get_confidence_mask() const
+{
+    return confidence_mask_;
+}
+
+int StreamingBackgroundExtractor::get_num_frames() const
+{
+    return num_frames_;
+}
+
+void StreamingBackgroundExtractor::set_num_threads(int num_threads)
+{
+    thread_pool_ = std::make_shared<ThreadPool>(num_threads);
+}
+
+void StreamingBackgroundExtractor::reset(cv::Size frame_size)
+{
+    num_frames_ = 0;
+    frame_size_ = frame_size;
+    working_size_ = cv::Size(int(resize_factor_ * frame_size.width), int(resize_factor_ * frame_size.height));
+
+    window_bins_.resize(window_size_);
+    for (auto &bins : window_bins_)
+        bins.create(working_size_);
+    histogram_.create(working_size_, num_bins_);
+
+    crt_background_.create(working_size_, CV_8UC3);
+    crt_background_bins_.create(working_size_);
+    background_.create(working_size_, CV_8UC3);
+    confidence_mask_.create(working_size_);
+}
+
+cv::Range StreamingBackgroundExtractor::get_band_rows(int band_id, int num_bands) const
+{
+    return cv::Range(band_id * working_size_.height / num_bands, (band_id + 1) * working_size_.height / num_bands);
+}
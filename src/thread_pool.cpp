@@ -0,0 +1,154 @@
+/*********************************************************************************************************************
+ * File : thread_pool.cpp                                                                                            *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include <algorithm>
+#include <memory>
+
+#include "thread_pool.h"
+
+ThreadPool::ThreadPool(int num_threads) : tasks_(16),
+                                          first_task_(0),
+                                          num_tasks_(0),
+                                          stop_(false)
+{
+    if (num_threads < 1)
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    workers_.reserve(num_threads);
+    for (int i = 0; i < num_threads; i++)
+        workers_.emplace_back(&ThreadPool::worker_loop, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    task_cv_.notify_all();
+    for (auto &worker : workers_)
+        worker.join();
+}
+
+int ThreadPool::get_num_threads() const
+{
+    return workers_.size();
+}
+
+std::future<void> ThreadPool::submit(std::function<void()> task)
+{
+    auto packaged_task = std::make_shared<std::packaged_task<void()>>(std::move(task));
+    std::future<void> future = packaged_task->get_future();
+
+    Task pool_task;
+    pool_task.fn = [packaged_task]() { (*packaged_task)(); };
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        push_task(std::move(pool_task));
+    }
+    task_cv_.notify_one();
+    return future;
+}
+
+void ThreadPool::run_parallel_job(ParallelJob &job)
+{
+    if (job.n <= 0)
+        return;
+
+    // The calling thread is one of the participants
+    const int num_helpers = std::min(get_num_threads(), job.n) - 1;
+    if (num_helpers > 0)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (int i = 0; i < num_helpers; i++)
+            {
+                Task task;
+                task.job = &job;
+                push_task(std::move(task));
+            }
+            job.num_pending_helpers = num_helpers;
+        }
+        if (num_helpers == 1)
+            task_cv_.notify_one();
+        else
+            task_cv_.notify_all();
+    }
+
+    work_on(job);
+
+    if (num_helpers > 0)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        // Withdraw the helpers that haven't started yet, since all the workers might be busy waiting for this loop
+        for (size_t k = 0; k < num_tasks_; k++)
+        {
+            Task &task = tasks_[(first_task_ + k) % tasks_.size()];
+            if (task.job == &job)
+            {
+                task.job = nullptr;
+                job.num_pending_helpers--;
+            }
+        }
+
+        // The remaining helpers are running and will be done soon
+        done_cv_.wait(lock, [&job]() { return job.num_pending_helpers == 0; });
+    }
+}
+
+void ThreadPool::work_on(ParallelJob &job)
+{
+    const int worker_id = job.next_worker_id++;
+    for (int i = job.next_index++; i < job.n; i = job.next_index++)
+        job.run(job.body, i, worker_id);
+}
+
+void ThreadPool::push_task(Task &&task)
+{
+    if (num_tasks_ == tasks_.size())
+    {
+        // Unroll the circular buffer into a larger one
+        std::vector<Task> tasks(2 * tasks_.size());
+        for (size_t k = 0; k < num_tasks_; k++)
+            tasks[k] = std::move(tasks_[(first_task_ + k) % tasks_.size()]);
+        tasks_.swap(tasks);
+        first_task_ = 0;
+    }
+    tasks_[(first_task_ + num_tasks_) % tasks_.size()] = std::move(task);
+    num_tasks_++;
+}
+
+void ThreadPool::worker_loop()
+{
+    while (true)
+    {
+        Task task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            task_cv_.wait(lock, [this]() { return stop_ || num_tasks_ > 0; });
+            if (num_tasks_ == 0)
+                return;
+            task = std::move(tasks_[first_task_]);
+            tasks_[first_task_] = Task();
+            first_task_ = (first_task_ + 1) % tasks_.size();
+            num_tasks_--;
+        }
+
+        if (task.job)
+        {
+            work_on(*task.job);
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            task.job->num_pending_helpers--;
+            done_cv_.notify_all();
+        }
+        else if (task.fn)
+        {
+            task.fn();
+        }
+    }
+}
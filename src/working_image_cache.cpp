@@ -0,0 +1,242 @@
+/*********************************************************************************************************************
+ * File : working_image_cache.cpp                                                                                    *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include <algorithm>
+#include <assert.h>
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+
+#include "working_image_cache.h"
+
+namespace bfs = boost::filesystem;
+namespace bip = boost::interprocess;
+
+namespace
+{
+const char cache_magic[8] = {'B', 'G', 'X', 'W', 'I', 'M', 'G', 'S'};
+const uint32_t cache_version = 2; ///< To increment whenever the layout of the file changes
+const std::string cache_extension = ".bgcache";
+
+struct CacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t num_images;
+    float resize_factor;
+    uint32_t reduced_decoding;               ///< Whether the JPEG decoder downsampled the images
+    int32_t width, height;                   ///< Size of the working images
+    int32_t original_width, original_height; ///< Size of the original images
+    uint64_t data_offset;                    ///< Offset of the pixels, aligned on a page
+};
+
+struct CacheEntry
+{
+    int64_t mtime;
+    uint64_t file_size;
+    uint32_t path_length; ///< Followed by the path, without null terminator
+};
+} // namespace
+
+WorkingImageCache::WorkingImageCache() : max_bytes_(0)
+{
+}
+
+WorkingImageCache::~WorkingImageCache() = default;
+
+void WorkingImageCache::set_directory(const std::string &dir_path, size_t max_bytes)
+{
+    dir_path_ = dir_path;
+    max_bytes_ = max_bytes;
+}
+
+bool WorkingImageCache::load(const std::vector<cv::String> &filenames, float resize_factor, bool reduced_decoding,
+                             std::vector<cv::Mat> &imgs, cv::Size &original_size)
+{
+    region_.reset();
+    if (dir_path_.empty())
+        return false;
+
+    const std::string cache_path = get_cache_path(filenames, resize_factor, reduced_decoding);
+    boost::system::error_code error;
+    if (!bfs::exists(cache_path, error))
+        return false;
+
+    try
+    {
+        const bip::file_mapping mapping(cache_path.c_str(), bip::read_only);
+        region_.reset(new bip::mapped_region(mapping, bip::read_only));
+    }
+    catch (bip::interprocess_exception &e)
+    {
+        std::cerr << "Unable to map the cache file " << cache_path << ": " << e.what() << std::endl;
+        return false;
+    }
+
+    // Validate the header
+    const char *data = static_cast<const char *>(region_->get_address());
+    const size_t num_bytes = region_->get_size();
+    CacheHeader header;
+    if (num_bytes < sizeof(header))
+        return false;
+    std::memcpy(&header, data, sizeof(header));
+    const size_t img_num_bytes = size_t(header.width) * header.height * 3;
+    if (std::memcmp(header.magic, cache_magic, sizeof(cache_magic)) != 0 || header.version != cache_version ||
+        header.resize_factor != resize_factor || header.reduced_decoding != uint32_t(reduced_decoding) ||
+        header.num_images != filenames.size() ||
+        header.data_offset + header.num_images * img_num_bytes > num_bytes)
+    {
+        region_.reset();
+        return false;
+    }
+
+    // Make sure none of the image files has changed
+    size_t offset = sizeof(header);
+    for (const auto &filename : filenames)
+    {
+        CacheEntry entry;
+        if (offset + sizeof(entry) > header.data_offset)
+        {
+            region_.reset();
+            return false;
+        }
+        std::memcpy(&entry, data + offset, sizeof(entry));
+        offset += sizeof(entry);
+        if (offset + entry.path_length > header.data_offset ||
+            filename.compare(0, std::string::npos, data + offset, entry.path_length) != 0 ||
+            entry.mtime != int64_t(bfs::last_write_time(filename.c_str(), error)) ||
+            entry.file_size != bfs::file_size(filename.c_str(), error) || error)
+        {
+            region_.reset();
+            return false;
+        }
+        offset += entry.path_length;
+    }
+    if (offset > header.data_offset)
+    {
+        region_.reset();
+        return false;
+    }
+
+    imgs.resize(filenames.size());
+    for (size_t i = 0; i < imgs.size(); i++)
+        imgs[i] = cv::Mat(header.height, header.width, CV_8UC3,
+                          const_cast<char *>(data + header.data_offset + i * img_num_bytes));
+    original_size = cv::Size(header.original_width, header.original_height);
+
+    // Mark the file as recently used
+    bfs::last_write_time(cache_path, std::time(nullptr), error);
+    return true;
+}
+
+bool WorkingImageCache::save(const std::vector<cv::String> &filenames, float resize_factor, bool reduced_decoding,
+                             const std::vector<cv::Mat> &imgs, cv::Size original_size)
+{
+    if (dir_path_.empty() || imgs.empty())
+        return false;
+
+    CacheHeader header;
+    std::memcpy(header.magic, cache_magic, sizeof(cache_magic));
+    header.version = cache_version;
+    header.num_images = imgs.size();
+    header.resize_factor = resize_factor;
+    header.reduced_decoding = reduced_decoding;
+    header.width = imgs[0].cols;
+    header.height = imgs[0].rows;
+    header.original_width = original_size.width;
+    header.original_height = original_size.height;
+
+    size_t entries_num_bytes = 0;
+    for (const auto &filename : filenames)
+        entries_num_bytes += sizeof(CacheEntry) + filename.size();
+    const size_t page_size = bip::mapped_region::get_page_size();
+    header.data_offset = (sizeof(header) + entries_num_bytes + page_size - 1) / page_size * page_size;
+    const size_t img_num_bytes = size_t(header.width) * header.height * 3;
+    const size_t num_bytes = header.data_offset + imgs.size() * img_num_bytes;
+    if (num_bytes > max_bytes_)
+        return false;
+
+    boost::system::error_code error;
+    bfs::create_directories(dir_path_, error);
+    const std::string cache_path = get_cache_path(filenames, resize_factor, reduced_decoding);
+    bfs::remove(cache_path, error);
+    evict(num_bytes);
+
+    // Write to a temporary file first, so that an interrupted write never leaves a truncated cache file behind
+    const std::string tmp_path = cache_path + ".tmp";
+    {
+        std::ofstream file(tmp_path.c_str(), std::ios::binary);
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        for (const auto &filename : filenames)
+        {
+            CacheEntry entry;
+            entry.mtime = bfs::last_write_time(filename.c_str(), error);
+            entry.file_size = bfs::file_size(filename.c_str(), error);
+            entry.path_length = filename.size();
+            file.write(reinterpret_cast<const char *>(&entry), sizeof(entry));
+            file.write(filename.c_str(), filename.size());
+        }
+        const std::vector<char> padding(header.data_offset - sizeof(header) - entries_num_bytes, 0);
+        file.write(padding.data(), padding.size());
+        for (const auto &img : imgs)
+        {
+            assert(img.type() == CV_8UC3 && img.cols == header.width && img.rows == header.height);
+            for (int y = 0; y < img.rows; y++)
+                file.write(img.ptr<char>(y), img.cols * 3);
+        }
+        if (!file || error)
+        {
+            std::cerr << "Unable to write the cache file " << tmp_path << std::endl;
+            bfs::remove(tmp_path, error);
+            return false;
+        }
+    }
+    bfs::rename(tmp_path, cache_path, error);
+    return !error;
+}
+
+std::string WorkingImageCache::get_cache_path(const std::vector<cv::String> &filenames, float resize_factor,
+                                              bool reduced_decoding) const
+{
+    std::ostringstream key;
+    for (const auto &filename : filenames)
+        key << bfs::absolute(filename.c_str()).string() << '\n';
+    key << resize_factor << '\n' << reduced_decoding;
+
+    std::ostringstream cache_filename;
+    cache_filename << std::hex << std::hash<std::string>()(key.str()) << cache_extension;
+    return (bfs::path(dir_path_) / cache_filename.str()).string();
+}
+
+void WorkingImageCache::evict(size_t num_bytes)
+{
+    boost::system::error_code error;
+    std::vector<std::pair<std::time_t, bfs::path>> cache_files;
+    size_t total_num_bytes = num_bytes;
+    for (bfs::directory_iterator it(dir_path_, error), end; !error && it != end; it.increment(error))
+    {
+        if (it->path().extension() != cache_extension)
+            continue;
+        cache_files.emplace_back(bfs::last_write_time(it->path(), error), it->path());
+        total_num_bytes += bfs::file_size(it->path(), error);
+    }
+
+    // Oldest first
+    std::sort(cache_files.begin(), cache_files.end());
+    for (const auto &cache_file : cache_files)
+    {
+        if (total_num_bytes <= max_bytes_)
+            break;
+        total_num_bytes -= bfs::file_size(cache_file.second, error);
+        bfs::remove(cache_file.second, error);
+    }
+}